@@ -2,6 +2,12 @@
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include "LineParser.h"
 
 #ifndef NULL
@@ -10,62 +16,108 @@
 
 #define FREE(X) if(X) free((void*)X)
 
-static char *cloneFirstWord(char *str)
+#define ARENA_ALIGN 16
+#define ARENA_FIRST_MIN 1024		/* smallest first block of a pipeline */
+#define ARENA_FIRST_MAX (64 << 10)	/* largest first block, later blocks double as needed */
+
+/* Bump allocator block. The first block of a pipeline is sized from the length of the line, */
+/* enough for a short pipeline; when it runs out, a block at least twice as large is chained */
+/* and further allocations come from it */
+struct cmdArena
 {
-    char *start = NULL;
-    char *end = NULL;
-    char *word;
+    struct cmdArena *next;	/* next block in chain */
+    struct cmdArena *current;	/* in the first block: the one allocations come from */
+    size_t size;		/* bytes available in data */
+    size_t used;		/* bytes handed out from data */
+    char data[];
+};
 
-    while (!end) {
-        switch (*str) {
-            case '>':
-            case '<':
-            case 0:
-                end = str - 1;
-                break;
-            case ' ':
-                if (start)
-                    end = str - 1;
-                break;
-            default:
-                if (!start)
-                    start = str;
-                break;
-        }
-        str++;
-    }
+/* Character classes of the lexer, looked up once per input byte */
+enum { CH_WORD = 0, CH_SPACE, CH_PIPE, CH_IN, CH_OUT, CH_AMP, CH_SEMI, CH_QUOTE, CH_ESCAPE, CH_DOLLAR, CH_GLOB, CH_COMMA, CH_CLOSE, CH_END };
 
-    if (start == NULL)
-        return NULL;
+#define CHAR_CLASSES \
+    ['\0'] = CH_END, \
+    [' '] = CH_SPACE, ['\t'] = CH_SPACE, ['\n'] = CH_SPACE, ['\r'] = CH_SPACE, ['\v'] = CH_SPACE, ['\f'] = CH_SPACE, \
+    ['|'] = CH_PIPE, ['<'] = CH_IN, ['>'] = CH_OUT, ['&'] = CH_AMP, [';'] = CH_SEMI, \
+    ['\''] = CH_QUOTE, ['"'] = CH_QUOTE, ['\\'] = CH_ESCAPE, ['$'] = CH_DOLLAR, \
+    ['*'] = CH_GLOB, ['?'] = CH_GLOB, ['['] = CH_GLOB
 
-    word = (char*) malloc(end-start+2);
-    strncpy(word, start, ((int)(end-start)+1)) ;
-    word[ (int)((end-start)+1)] = 0;
+static const unsigned char charClass[256] = { CHAR_CLASSES };
 
-    return word;
+/* Inside the braces of a fan-out ',' and '}' also end a word, elsewhere they are plain */
+/* characters, as in 'find -exec cmd {} +' */
+static const unsigned char groupClass[256] = { CHAR_CLASSES, [','] = CH_COMMA, ['}'] = CH_CLOSE };
+
+enum { TOK_WORD, TOK_PIPE, TOK_FANOUT, TOK_IN, TOK_HEREDOC, TOK_HERESTRING, TOK_OUT, TOK_AMP, TOK_COMMA, TOK_CLOSE, TOK_SEMI, TOK_AND, TOK_OR, TOK_END };
+
+/* A token is a view into the parsed line, nothing is copied until a word is stored in a cmdLine */
+typedef struct token
+{
+    int type;		/* one of the TOK_ values */
+    int offset;		/* start of the token in the line */
+    int length;		/* bytes the token spans in the line, quotes and escapes included */
+    int quoted;		/* the word has quotes or escapes to remove when it is copied */
+    int glob;		/* the word has an unquoted '*', '?' or '[' */
+    int substitution;	/* the word has a $(...) command substitution */
+} token;
+
+static cmdArena *newArena(size_t size, cmdArena *next)
+{
+    cmdArena *arena = (cmdArena*) malloc(sizeof(cmdArena) + size);
+    arena->next = next;
+    arena->current = arena;
+    arena->size = size;
+    arena->used = 0;
+    return arena;
 }
 
-static void extractRedirections(char *strLine, cmdLine *pCmdLine)
+static void freeArena(cmdArena *arena)
 {
-    char *s = strLine;
+    cmdArena *next;
 
-    while ( (s = strpbrk(s,"<>")) ) {
-        if (*s == '<') {
-            FREE(pCmdLine->inputRedirect);
-            pCmdLine->inputRedirect = cloneFirstWord(s+1);
-        }
-        else {
-            FREE(pCmdLine->outputRedirect);
-            pCmdLine->outputRedirect = cloneFirstWord(s+1);
-        }
+    for (; arena; arena = next) {
+      next = arena->next;
+      free(arena);
+    }
+}
+
+/* Allocates from the arena when given one, from the heap otherwise */
+static void *parserAlloc(cmdArena *arena, size_t size, int align)
+{
+    cmdArena *block;
+    size_t start;
+
+    if (!arena)
+        return malloc(size);
 
-        *s++ = 0;
+    block = arena->current;
+    start = align ? (block->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1) : block->used;
+    if (start + size > block->size) {
+        block = newArena(size > 2 * block->size ? size : 2 * block->size, arena->next);
+        arena->next = arena->current = block;
+        start = 0;
     }
+    block->used = start + size;
+    return block->data + start;
+}
+
+/* First block for a pipeline parsed from a line of the given length: one cmdLine and its two */
+/* word arrays, one argument pointer per word (a word and its separator take at least two bytes), */
+/* and the words themselves (at most the line length plus one NUL per word, twice that for glob */
+/* patterns). Only further stages need more. */
+static cmdArena *pipelineArena(size_t length)
+{
+    size_t size = sizeof(cmdLine) + 3 * ARENA_ALIGN + 2 * sizeof(char*)
+                  + (length / 2 + 1) * sizeof(char*) + 3 * (length + 1);
+
+    if (size < ARENA_FIRST_MIN)
+      size = ARENA_FIRST_MIN;
+    return newArena(size > ARENA_FIRST_MAX ? ARENA_FIRST_MAX : size, NULL);
 }
 
-static char *strClone(const char *source)
+static char *strClone(const char *source, cmdArena *arena)
 {
-    char* clone = (char*)malloc(strlen(source) + 1);
+    char* clone = (char*)parserAlloc(arena, strlen(source) + 1, 0);
     strcpy(clone, source);
     return clone;
 }
@@ -74,93 +126,507 @@ static int isEmpty(const char *str)
 {
   if (!str)
     return 1;
-  
+
   while (*str)
     if (!isspace(*(str++)))
       return 0;
-    
+
   return 1;
 }
 
-static cmdLine *parseSingleCmdLine(const char *strLine)
+/* Index just past the ')' closing the $( at s[i], or of the end of the line if it is not closed. */
+/* Quotes, escapes and nested substitutions inside are skipped as a whole. */
+static int skipSubstitution(const unsigned char *s, int i)
+{
+    int depth = 1;
+    unsigned char quote;
+
+    for (i += 2; s[i] && depth; i++) {
+        if (s[i] == '\\' && s[i+1])
+            i++;
+        else if (s[i] == '\'' || s[i] == '"') {
+            quote = s[i++];
+            while (s[i] && s[i] != quote) {
+                if (quote == '"' && s[i] == '$' && s[i+1] == '(')
+                    i = skipSubstitution(s, i);
+                else
+                    i += (quote == '"' && s[i] == '\\' && s[i+1]) ? 2 : 1;
+            }
+            if (!s[i])
+                break;
+        }
+        else if (s[i] == '$' && s[i+1] == '(') {
+            depth++;
+            i++;
+        }
+        else if (s[i] == '(')
+            depth++;
+        else if (s[i] == ')')
+            depth--;
+    }
+    return i;
+}
+
+/* Scans the token starting at *pos and moves *pos past it. Every byte of the line is classified */
+/* exactly once, through charClass (groupClass inside fan-out braces); quoted strings and escapes */
+/* only extend the current word, as does a $(...) command substitution. */
+static void nextToken(const char *line, int *pos, token *tok, int group)
+{
+    const unsigned char *s = (const unsigned char*)line;
+    const unsigned char *classes = group ? groupClass : charClass;
+    int i = *pos;
+    unsigned char quote;
+
+    while (classes[s[i]] == CH_SPACE)
+        i++;
+
+    tok->offset = i;
+    tok->quoted = tok->glob = tok->substitution = 0;
+
+    switch (classes[s[i]]) {
+        case CH_END:
+            tok->type = TOK_END;
+            break;
+        case CH_PIPE:
+            tok->type = s[i+1] == '&' ? TOK_FANOUT : s[i+1] == '|' ? TOK_OR : TOK_PIPE;
+            i += tok->type == TOK_PIPE ? 1 : 2;
+            break;
+        case CH_COMMA:
+            tok->type = TOK_COMMA;
+            i++;
+            break;
+        case CH_CLOSE:
+            tok->type = TOK_CLOSE;
+            i++;
+            break;
+        case CH_IN:
+            tok->type = s[i+1] != '<' ? TOK_IN : s[i+2] != '<' ? TOK_HEREDOC : TOK_HERESTRING;
+            i += tok->type == TOK_IN ? 1 : tok->type == TOK_HEREDOC ? 2 : 3;
+            break;
+        case CH_OUT:
+            tok->type = TOK_OUT;
+            i++;
+            break;
+        case CH_AMP:
+            tok->type = s[i+1] == '&' ? TOK_AND : TOK_AMP;
+            i += tok->type == TOK_AND ? 2 : 1;
+            break;
+        case CH_SEMI:
+            tok->type = TOK_SEMI;
+            i++;
+            break;
+        default:
+            tok->type = TOK_WORD;
+            for (;;) {
+                while (classes[s[i]] == CH_WORD)
+                    i++;
+
+                if (classes[s[i]] == CH_GLOB) {
+                    tok->glob = 1;
+                    i++;
+                }
+                else if (classes[s[i]] == CH_QUOTE) {
+                    /* Inside double quotes a backslash still escapes the next character. */
+                    /* An unterminated quote runs to the end of the line, minus its newline. */
+                    quote = s[i++];
+                    while (s[i] && s[i] != quote && !(s[i] == '\n' && !s[i+1])) {
+                        if (quote == '"' && s[i] == '$' && s[i+1] == '(')
+                            i = skipSubstitution(s, i);
+                        else
+                            i += (quote == '"' && s[i] == '\\' && s[i+1]) ? 2 : 1;
+                    }
+                    if (s[i] == quote)
+                        i++;
+                    tok->quoted = 1;
+                }
+                else if (classes[s[i]] == CH_ESCAPE) {
+                    i += s[i+1] ? 2 : 1;
+                    tok->quoted = 1;
+                }
+                else if (classes[s[i]] == CH_DOLLAR) {
+                    if (s[i+1] == '(') {
+                        i = skipSubstitution(s, i);
+                        tok->quoted = tok->substitution = 1;
+                    }
+                    else if (s[i+1] == '?' || strncmp((const char*)s + i, "$PIPESTATUS", 11) == 0) {
+                        /* Copied as a marker, $? being no pattern */
+                        i += s[i+1] == '?' ? 2 : 11;
+                        tok->quoted = 1;
+                    }
+                    else
+                        i++;
+                }
+                else
+                    break;
+            }
+            break;
+    }
+
+    tok->length = i - tok->offset;
+    *pos = i;
+}
+
+/* Copies the command of the substitution starting at s (its "$(") to out, between a SUBST_BEGIN or */
+/* SUBST_QUOTED and a SUBST_END marker, and returns the end of the substitution in the line */
+static const char *cloneSubstitution(const char *line, const char *s, char **out, int quoted)
+{
+    const char *close = line + skipSubstitution((const unsigned char*)line, s - line);
+    const char *text_end = close[-1] == ')' && close - s > 2 ? close - 1 : close;
+
+    *(*out)++ = quoted ? SUBST_QUOTED : SUBST_BEGIN;
+    memcpy(*out, s + 2, text_end - (s + 2));
+    *out += text_end - (s + 2);
+    *(*out)++ = SUBST_END;
+    return close;
+}
+
+/* Appends a character that was quoted or escaped in the line; in a glob pattern it is escaped */
+/* again, so that it only matches itself */
+static void putLiteral(char **out, char c, int glob)
+{
+    if (glob && (c == '*' || c == '?' || c == '[' || c == '\\'))
+        *(*out)++ = '\\';
+    *(*out)++ = c;
+}
+
+/* Copies a word token out of the line, removing its quotes and escapes. extra bytes are left */
+/* free after it for the caller to append to. Command substitutions are kept for the caller to */
+/* run, marked as described in LineParser.h; the markers take no more room than "$(" and ")". */
+/* $? and $PIPESTATUS outside single quotes become a STATUS_LAST or STATUS_PIPE marker. */
+/* A WORD_PATTERN is copied as a glob pattern: GLOB_PATTERN first, which with the escapes added */
+/* by putLiteral takes at most twice the room of the token. A WORD_WHOLE (redirection path, */
+/* '<<<' word or assignment) is never split, so its substitutions are all marked as quoted. */
+enum { WORD_ARG, WORD_PATTERN, WORD_WHOLE };
+
+static char *cloneWord(const char *line, const token *tok, cmdArena *arena, int extra, int kind)
+{
+    const char *s = line + tok->offset;
+    const char *end = s + tok->length;
+    int glob = kind == WORD_PATTERN;
+    char *word = (char*) parserAlloc(arena, (glob ? 2 * tok->length + 2 : tok->length + 1) + extra, 0);
+    char *out = word;
+    char quote = 0;
+
+    if (glob)
+        *out++ = GLOB_PATTERN;
+    if (!tok->quoted) {
+        memcpy(out, s, tok->length);
+        out[tok->length] = 0;
+        return word;
+    }
+
+    while (s < end) {
+        if (*s == '$' && s+1 < end && s[1] == '(' && quote != '\'') {
+            s = cloneSubstitution(line, s, &out, quote || kind == WORD_WHOLE);
+            continue;
+        }
+        if (*s == '$' && s+1 < end && s[1] == '?' && quote != '\'') {
+            *out++ = STATUS_LAST;
+            s += 2;
+            continue;
+        }
+        if (*s == '$' && end - s >= 11 && strncmp(s, "$PIPESTATUS", 11) == 0 && quote != '\'') {
+            *out++ = STATUS_PIPE;
+            s += 11;
+            continue;
+        }
+        if (quote) {
+            if (*s == quote)
+                quote = 0;
+            else if (quote == '"' && *s == '\\' && s+1 < end && strchr("\"\\$`", s[1]))
+                putLiteral(&out, *++s, glob);
+            else
+                putLiteral(&out, *s, glob);
+        }
+        else if (*s == '\'' || *s == '"')
+            quote = *s;
+        else if (*s == '\\' && s+1 < end)
+            putLiteral(&out, *++s, glob);
+        else
+            *out++ = *s;
+        s++;
+    }
+    *out = 0;
+
+    return word;
+}
+
+/* Arguments of the stage being parsed. They are collected here and copied into an exactly */
+/* sized, NULL terminated array once the stage is complete, so the arena never holds dead arrays */
+typedef struct argList
+{
+    char **items;		/* inline_items until more room is needed, then the heap */
+    int count;
+    int capacity;
+    char *inline_items[64];
+} argList;
+
+static void addArg(argList *args, char *arg)
 {
-    char *delimiter = " ";
-    char *line, *result;
-    
-    if (isEmpty(strLine))
-      return NULL;
-    
-    cmdLine* pCmdLine = (cmdLine*)malloc( sizeof(cmdLine) ) ;
+    if (args->count == args->capacity) {
+        args->capacity *= 2;
+        if (args->items == args->inline_items) {
+            args->items = (char**) malloc(args->capacity * sizeof(char*));
+            memcpy(args->items, args->inline_items, args->count * sizeof(char*));
+        }
+        else
+            args->items = (char**) realloc(args->items, args->capacity * sizeof(char*));
+    }
+    args->items[args->count++] = arg;
+}
+
+/* Exactly sized, NULL terminated copy of the list, which is emptied */
+static char **takeArgs(argList *args, cmdArena *arena)
+{
+    char **items = (char**) parserAlloc(arena, (args->count + 1) * sizeof(char*), 1);
+
+    memcpy(items, args->items, args->count * sizeof(char*));
+    items[args->count] = NULL;
+    args->count = 0;
+    return items;
+}
+
+static void finishStage(cmdLine *pCmdLine, argList *args, argList *assigns, cmdArena *arena)
+{
+    pCmdLine->argCount = args->count;
+    pCmdLine->arguments = takeArgs(args, arena);
+    if (assigns->count) {
+      pCmdLine->assignmentCount = assigns->count;
+      pCmdLine->assignments = takeArgs(assigns, arena);
+    }
+}
+
+static void initArgs(argList *args)
+{
+    args->items = args->inline_items;
+    args->count = 0;
+    args->capacity = sizeof(args->inline_items) / sizeof(args->inline_items[0]);
+}
+
+/* NAME=value, NAME being unquoted letters, digits and '_', not starting with a digit */
+static int isAssignment(const char *line, const token *tok)
+{
+    const char *s = line + tok->offset;
+    int i = 0;
+
+    if (!isalpha((unsigned char)s[0]) && s[0] != '_')
+      return 0;
+    while (i < tok->length && (isalnum((unsigned char)s[i]) || s[i] == '_'))
+      i++;
+    return i < tok->length && s[i] == '=';
+}
+
+static cmdLine *newCmdLine(cmdArena *arena, int idx)
+{
+    cmdLine* pCmdLine = (cmdLine*)parserAlloc(arena, sizeof(cmdLine), 1) ;
     memset(pCmdLine, 0, sizeof(cmdLine));
-    
-    line = strClone(strLine);
-         
-    extractRedirections(line, pCmdLine);
-    
-    result = strtok( line, delimiter);    
-    while( result && pCmdLine->argCount < MAX_ARGUMENTS-1) {
-        ((char**)pCmdLine->arguments)[pCmdLine->argCount++] = strClone(result);
-        result = strtok ( NULL, delimiter);
-    }
-
-    FREE(line);
+    pCmdLine->arena = arena;
+    pCmdLine->idx = idx;
     return pCmdLine;
 }
 
-static cmdLine* _parseCmdLines(char *line)
+/* A pipeline runs up to the end of the line, '&' or a list operator */
+static int endsPipeline(int type)
 {
-	char *nextStrCmd;
-	cmdLine *pCmdLine;
-	char pipeDelimiter = '|';
-	
-	if (isEmpty(line))
-	  return NULL;
-	
-	nextStrCmd = strchr(line , pipeDelimiter);
-	if (nextStrCmd)
-	  *nextStrCmd = 0;
-	
-	pCmdLine = parseSingleCmdLine(line);
-	if (!pCmdLine)
-	  return NULL;
-	
-	if (nextStrCmd)
-	  pCmdLine->next = _parseCmdLines(nextStrCmd+1);
+	return type == TOK_END || type == TOK_AMP || type == TOK_SEMI || type == TOK_AND || type == TOK_OR;
+}
+
+/* Single pass over the line from *pos: tokens are consumed as they are scanned and stored straight */
+/* into the chain, with no limit on the number of arguments. '|' starts the next stage, '<'/'>' take the following word as file name and '&' */
+/* ends the pipeline, marking it non-blocking, as do ';', '&&' and '||'. An empty stage ends the chain, */
+/* the rest of the pipeline is skipped. */
+/* 'producer |& {consumer, consumer}' is a fan-out: the consumers follow the producer in the chain, */
+/* each marked as fanout where it starts; a consumer may be a pipeline itself. Without the braces */
+/* the rest of the line is the single consumer. Only the end of the pipeline may follow the */
+/* closing brace, anything else is a syntax error: *error is set and the chain is dropped. */
+/* On return *pos is past the token that ended the pipeline, and *ending is its type. */
+static cmdLine *parseCmdLinesWith(const char *strLine, int *pos_in, int *ending, const char **error, cmdArena *arena)
+{
+	token tok, file;
+	int pos = *pos_in, after, idx = 0, group = 0, fanned = 0;
+	char fanout = 0;	/* the next stage starts a consumer */
+	cmdLine *head = NULL, *pCmdLine = NULL, *last = NULL;
+	const char **redirect;
+	argList args, assigns;
+
+	initArgs(&args);
+	initArgs(&assigns);
+
+	for (nextToken(strLine, &pos, &tok, group); !endsPipeline(tok.type); nextToken(strLine, &pos, &tok, group))
+	{
+	  if (tok.type == TOK_PIPE || tok.type == TOK_FANOUT || tok.type == TOK_COMMA || tok.type == TOK_CLOSE) {
+	    if (!pCmdLine || (tok.type == TOK_FANOUT && fanned))
+	      break;
+	    finishStage(pCmdLine, &args, &assigns, arena);
+	    pCmdLine = NULL;
+
+	    if (tok.type == TOK_CLOSE) {
+	      nextToken(strLine, &pos, &tok, 0);
+	      if (!endsPipeline(tok.type))
+	        *error = "unexpected text after '}'";
+	      break;
+	    }
+	    if (tok.type == TOK_FANOUT) {
+	      fanned = 1;
+	      pos += strspn(strLine + pos, " \t");
+	      if (strLine[pos] == '{') {
+	        pos++;
+	        group = 1;
+	      }
+	    }
+	    fanout = tok.type != TOK_PIPE;
+	    continue;
+	  }
+
+	  if (!pCmdLine) {
+	    pCmdLine = newCmdLine(arena, idx++);
+	    pCmdLine->fanout = fanout;
+	    fanout = 0;
+	    if (last)
+	      last->next = pCmdLine;
+	    else
+	      head = pCmdLine;
+	    last = pCmdLine;
+	  }
+
+	  /* NAME=value words before the command are assignments to its environment */
+	  if (tok.type == TOK_WORD && args.count == 0 && isAssignment(strLine, &tok)) {
+	    addArg(&assigns, cloneWord(strLine, &tok, arena, 0, WORD_WHOLE));
+	    continue;
+	  }
+	  if (tok.type == TOK_WORD) {
+	    addArg(&args, cloneWord(strLine, &tok, arena, 0, tok.glob && !tok.substitution ? WORD_PATTERN : WORD_ARG));
+	    continue;
+	  }
+
+	  /* Redirection, the file name is the next word if there is one. For '<<<' the word, plus a */
+	  /* newline, is the input itself; for '<<' it is the delimiter of the here-doc body, which */
+	  /* the caller reads and stores with replaceHereData. Of '<', '<<' and '<<<' the last one wins. */
+	  if (tok.type == TOK_OUT) {
+	    if (!arena)
+	      FREE(pCmdLine->outputRedirect);
+	    pCmdLine->outputRedirect = NULL;
+	    redirect = (const char**)&pCmdLine->outputRedirect;
+	  }
+	  else {
+	    if (!arena) {
+	      FREE(pCmdLine->inputRedirect);
+	      FREE(pCmdLine->hereData);
+	    }
+	    pCmdLine->inputRedirect = pCmdLine->hereData = NULL;
+	    pCmdLine->hereDoc = 0;
+	    redirect = (const char**)(tok.type == TOK_IN ? &pCmdLine->inputRedirect : &pCmdLine->hereData);
+	  }
+
+	  after = pos;
+	  nextToken(strLine, &after, &file, group);
+	  if (file.type == TOK_WORD) {
+	    *redirect = cloneWord(strLine, &file, arena, tok.type == TOK_HERESTRING, WORD_WHOLE);
+	    if (tok.type == TOK_HERESTRING)
+	      strcat((char*)*redirect, "\n");
+	    pCmdLine->hereDoc = tok.type == TOK_HEREDOC;
+	    pos = after;
+	  }
+	}
+
+	/* A stage that ended the chain early: skip to the end of the pipeline */
+	while (!endsPipeline(tok.type))
+	  nextToken(strLine, &pos, &tok, 0);
+
+	if (pCmdLine)
+	  finishStage(pCmdLine, &args, &assigns, arena);
+	if (last)
+	  last->blocking = tok.type == TOK_AMP ? 0 : 1;
+
+	if (args.items != args.inline_items)
+	  free(args.items);
+	if (assigns.items != assigns.inline_items)
+	  free(assigns.items);
 
-	return pCmdLine;
+	*pos_in = pos;
+	*ending = tok.type;
+	if (*error && head && !arena) {
+	  freeCmdLines(head);
+	  head = NULL;
+	}
+	return *error ? NULL : head;
 }
 
 cmdLine *parseCmdLines(const char *strLine)
 {
-	char* line, *ampersand;
-	cmdLine *head, *last;
-	int idx = 0;
-	
+	int pos = 0, ending;
+	const char *error = NULL;
+
+	return parseCmdLinesWith(strLine, &pos, &ending, &error, NULL);
+}
+
+cmdLine *parseCmdLinesArena(const char *strLine)
+{
+	int pos = 0, ending;
+	const char *error = NULL;
+	cmdArena *arena;
+	cmdLine *head;
+
 	if (isEmpty(strLine))
 	  return NULL;
-	
-	line = strClone(strLine);
-	if (line[strlen(line)-1] == '\n')
-	  line[strlen(line)-1] = 0;
-	
-	ampersand = strchr( line,  '&');
-	if (ampersand)
-	  *(ampersand) = 0;
-		
-	if ( (last = head = _parseCmdLines(line)) )
-	{	
-	  while (last->next)
-	    last = last->next;
-	  last->blocking = ampersand? 0:1;
-	}
-	
-	for (last = head; last; last = last->next)
-		last->idx = idx++;
-			
-	FREE(line);
+
+	arena = pipelineArena(strlen(strLine));
+	head = parseCmdLinesWith(strLine, &pos, &ending, &error, arena);
+	if (!head)
+	  freeArena(arena);
 	return head;
 }
 
+/* Parses the pipelines of the line one after the other in a single pass, each into its own arena, */
+/* so that each one can be handed on and freed on its own. '&' stays with the pipeline it puts in */
+/* the background. Empty pipelines are only kept next to '&&' or '||', where they are a syntax */
+/* error; parsing stops at the first malformed pipeline, kept with its error. */
+cmdList *parseCmdList(const char *strLine)
+{
+	int pos = 0, ending, connector = LIST_SEQ;
+	size_t length = strlen(strLine);
+	cmdList *head = NULL, *last = NULL, *item;
+	cmdLine *pipeline;
+	cmdArena *arena;
+	const char *error = NULL;
+
+	do {
+	  arena = pipelineArena(length - pos);
+	  pipeline = parseCmdLinesWith(strLine, &pos, &ending, &error, arena);
+	  if (!pipeline)
+	    freeArena(arena);
+
+	  item = NULL;
+	  if (pipeline || error || connector != LIST_SEQ || ending == TOK_AND || ending == TOK_OR) {
+	    item = (cmdList*) malloc(sizeof(cmdList));
+	    item->pipeline = pipeline;
+	    item->connector = LIST_SEQ;
+	    item->error = pipeline ? NULL : error ? error : "missing command";
+	    item->next = NULL;
+	    if (last)
+	      last->next = item;
+	    else
+	      head = item;
+	    last = item;
+	  }
+	  connector = ending == TOK_AND ? LIST_AND : ending == TOK_OR ? LIST_OR : LIST_SEQ;
+	  if (item)
+	    item->connector = connector;
+	} while (ending != TOK_END && !error);
+
+	return head;
+}
+
+void freeCmdList(cmdList *list)
+{
+	cmdList *next;
+
+	for (; list; list = next) {
+	  next = list->next;
+	  freeCmdLines(list->pipeline);
+	  free(list);
+	}
+}
 
 void freeCmdLines(cmdLine *pCmdLine)
 {
@@ -168,10 +634,21 @@ void freeCmdLines(cmdLine *pCmdLine)
   if (!pCmdLine)
     return;
 
+  /* Every node and string of an arena chain lives in the arena blocks */
+  if (pCmdLine->arena) {
+    freeArena(pCmdLine->arena);
+    return;
+  }
+
   FREE(pCmdLine->inputRedirect);
   FREE(pCmdLine->outputRedirect);
+  FREE(pCmdLine->hereData);
   for (i=0; i<pCmdLine->argCount; ++i)
       FREE(pCmdLine->arguments[i]);
+  FREE(pCmdLine->arguments);
+  for (i=0; i<pCmdLine->assignmentCount; ++i)
+      FREE(pCmdLine->assignments[i]);
+  FREE(pCmdLine->assignments);
 
   if (pCmdLine->next)
 	  freeCmdLines(pCmdLine->next);
@@ -179,12 +656,428 @@ void freeCmdLines(cmdLine *pCmdLine)
   FREE(pCmdLine);
 }
 
+void replaceHereData(cmdLine *pCmdLine, const char *data)
+{
+  if (!pCmdLine->arena)
+    FREE(pCmdLine->hereData);
+  pCmdLine->hereData = strClone(data, pCmdLine->arena);
+  pCmdLine->hereDoc = 0;
+}
+
+void replaceRedirect(cmdLine *pCmdLine, int output, const char *path)
+{
+  const char **redirect = output ? &pCmdLine->outputRedirect : &pCmdLine->inputRedirect;
+
+  if (!pCmdLine->arena)
+    FREE(*redirect);
+  *redirect = strClone(path, pCmdLine->arena);
+}
+
+int replaceCmdAssignment(cmdLine *pCmdLine, int num, const char *newString)
+{
+  if (num >= pCmdLine->assignmentCount)
+    return 0;
+
+  if (!pCmdLine->arena)
+    FREE(pCmdLine->assignments[num]);
+  ((char**)pCmdLine->assignments)[num] = strClone(newString, pCmdLine->arena);
+  return 1;
+}
+
 int replaceCmdArg(cmdLine *pCmdLine, int num, const char *newString)
 {
   if (num >= pCmdLine->argCount)
     return 0;
-  
-  FREE(pCmdLine->arguments[num]);
-  ((char**)pCmdLine->arguments)[num] = strClone(newString);
+
+  if (!pCmdLine->arena)
+    FREE(pCmdLine->arguments[num]);
+  ((char**)pCmdLine->arguments)[num] = strClone(newString, pCmdLine->arena);
+  return 1;
+}
+
+/* spliceCmdArgs, with words either copied or already allocated the way the chain frees them */
+static int spliceWords(cmdLine *pCmdLine, int num, char * const *words, int count, int clone)
+{
+  int i, argCount = pCmdLine->argCount - 1 + count;
+  char **arguments;
+
+  if (num >= pCmdLine->argCount)
+    return 0;
+
+  arguments = (char**) parserAlloc(pCmdLine->arena, (argCount + 1) * sizeof(char*), 1);
+  memcpy(arguments, pCmdLine->arguments, num * sizeof(char*));
+  for (i = 0; i < count; i++)
+    arguments[num + i] = clone ? strClone(words[i], pCmdLine->arena) : words[i];
+  /* The rest, NULL included */
+  memcpy(arguments + num + count, pCmdLine->arguments + num + 1, (pCmdLine->argCount - num) * sizeof(char*));
+
+  if (!pCmdLine->arena) {
+    FREE(pCmdLine->arguments[num]);
+    FREE(pCmdLine->arguments);
+  }
+  pCmdLine->arguments = arguments;
+  pCmdLine->argCount = argCount;
   return 1;
 }
+
+int spliceCmdArgs(cmdLine *pCmdLine, int num, char * const *words, int count)
+{
+  return spliceWords(pCmdLine, num, words, count, 1);
+}
+
+/* Glob expansion. A pattern is split at '/' into components; literal components are appended to */
+/* the path as they are, the others are matched against the entries of the directory read so far. */
+/* Directories are read with getdents64 in GLOB_BATCH byte batches, entries are rejected on the */
+/* literal prefix and suffix of the component before the full match, and d_type tells which of */
+/* them are directories, so only entries the file system gives no type for, or symlinks that may */
+/* lead to a directory, cost a stat. */
+
+#define GLOB_BATCH (1 << 20)
+
+struct linuxDirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+typedef struct globComponent
+{
+    char *pattern;	/* the component, NUL terminated, escapes kept */
+    int literal;	/* no '*', '?' or [...] in it: the name itself, escapes removed */
+    int globstar;	/* the component is '**': any number of directories */
+    size_t prefix;	/* literal bytes every match starts with */
+    const char *suffix;	/* literal bytes every match ends with */
+    size_t suffixLength;
+} globComponent;
+
+typedef struct globWalk
+{
+    char *path;		/* directory being read, with its trailing '/'; empty for the current one */
+    size_t length, capacity;
+    char **batches;	/* one getdents64 buffer per directory depth, reused between siblings */
+    int depth, depths;
+    char *names;	/* the matches, NUL terminated one after the other */
+    size_t used, size;
+    int count;
+} globWalk;
+
+/* The ']' closing the class opened by the '[' at p, NULL if there is none */
+static const char *classEnd(const char *p)
+{
+    p++;
+    if (*p == '!' || *p == '^')
+      p++;
+    if (*p == ']')
+      p++;
+    for (; *p && *p != ']'; p++)
+      if (*p == '\\' && p[1])
+        p++;
+    return *p ? p : NULL;
+}
+
+/* Whether c is in the class between p (just past the '[') and its closing ']' at end */
+static int classMatch(const char *p, const char *end, unsigned char c)
+{
+    int negate = *p == '!' || *p == '^', found = 0;
+    unsigned char low, high;
+
+    if (negate)
+      p++;
+    for (; p < end; p++) {
+      if (*p == '\\' && p + 1 < end)
+        p++;
+      low = high = *p;
+      if (p[1] == '-' && p + 2 < end) {
+        p += 2;
+        if (*p == '\\' && p + 1 < end)
+          p++;
+        high = *p;
+      }
+      if (c >= low && c <= high)
+        found = 1;
+    }
+    return found != negate;
+}
+
+/* Matches name against the pattern p, backtracking to the last '*' on a mismatch */
+static int globMatch(const char *p, const char *name)
+{
+    const char *star = NULL, *starName = NULL, *end;
+    int matched;
+
+    while (*name) {
+      if (*p == '*') {
+        while (*p == '*')
+          p++;
+        star = p;
+        starName = name;
+        continue;
+      }
+      matched = 0;
+      if (*p == '?') {
+        matched = 1;
+        p++;
+      }
+      else if (*p == '[' && (end = classEnd(p))) {
+        if (classMatch(p + 1, end, *name)) {
+          matched = 1;
+          p = end + 1;
+        }
+      }
+      else if (*p == '\\' && p[1]) {
+        if (p[1] == *name) {
+          matched = 1;
+          p += 2;
+        }
+      }
+      else if (*p == *name) {
+        matched = 1;
+        p++;
+      }
+
+      if (matched)
+        name++;
+      else if (star) {
+        p = star;
+        name = ++starName;
+      }
+      else
+        return 0;
+    }
+    while (*p == '*')
+      p++;
+    return !*p;
+}
+
+static int isGlob(const char *p)
+{
+    for (; *p; p++) {
+      if (*p == '\\' && p[1])
+        p++;
+      else if (*p == '*' || *p == '?' || (*p == '[' && classEnd(p)))
+        return 1;
+    }
+    return 0;
+}
+
+/* Removes the escapes of a pattern in place */
+static void unescape(char *s)
+{
+    char *out = s;
+
+    for (; *s; s++) {
+      if (*s == '\\' && s[1])
+        s++;
+      *out++ = *s;
+    }
+    *out = 0;
+}
+
+static void setComponent(globComponent *component, char *pattern)
+{
+    size_t length = strlen(pattern), start = length;
+
+    component->pattern = pattern;
+    component->globstar = strcmp(pattern, "**") == 0;
+    component->literal = !isGlob(pattern);
+    if (component->literal) {
+      unescape(pattern);
+      return;
+    }
+    component->prefix = strcspn(pattern, "*?[\\");
+    while (start > 0 && !strchr("*?[]\\", pattern[start - 1]))
+      start--;
+    component->suffix = pattern + start;
+    component->suffixLength = length - start;
+}
+
+static void pathAppend(globWalk *walk, const char *name, size_t length)
+{
+    if (walk->length + length + 2 > walk->capacity) {
+      walk->capacity = 2 * (walk->length + length + 2);
+      walk->path = (char*) realloc(walk->path, walk->capacity);
+    }
+    memcpy(walk->path + walk->length, name, length);
+    walk->length += length;
+    walk->path[walk->length] = 0;
+}
+
+static void addMatch(globWalk *walk)
+{
+    if (walk->used + walk->length + 1 > walk->size) {
+      walk->size = 2 * (walk->used + walk->length + 1);
+      walk->names = (char*) realloc(walk->names, walk->size);
+    }
+    memcpy(walk->names + walk->used, walk->path, walk->length + 1);
+    walk->used += walk->length + 1;
+    walk->count++;
+}
+
+/* Matches components[i] and the ones after it in the directory walk->path */
+static void globDirectory(globWalk *walk, globComponent *components, int i, int count)
+{
+    globComponent *component = components + i;
+    int last = i == count - 1, fd, isDir;
+    size_t base = walk->length, nameLength;
+    struct linuxDirent64 *entry;
+    struct stat info;
+    char *batch, *name;
+    long got, offset;
+
+    if (component->literal) {
+      pathAppend(walk, component->pattern, strlen(component->pattern));
+      if (!last) {
+        pathAppend(walk, "/", 1);
+        globDirectory(walk, components, i + 1, count);
+      }
+      else if (lstat(walk->path, &info) == 0)
+        addMatch(walk);
+      walk->path[walk->length = base] = 0;
+      return;
+    }
+    /* '**' standing for no directory at all */
+    if (component->globstar && !last)
+      globDirectory(walk, components, i + 1, count);
+
+    fd = open(walk->length ? walk->path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+      return;
+    if (walk->depth == walk->depths) {
+      walk->batches = (char**) realloc(walk->batches, ++walk->depths * sizeof(char*));
+      walk->batches[walk->depth] = (char*) malloc(GLOB_BATCH);
+    }
+    batch = walk->batches[walk->depth];
+
+    while ((got = syscall(SYS_getdents64, fd, batch, GLOB_BATCH)) > 0) {
+      for (offset = 0; offset < got; offset += entry->d_reclen) {
+        entry = (struct linuxDirent64*)(batch + offset);
+        name = entry->d_name;
+        /* Wildcards never match '.' and '..', nor a leading '.' the pattern does not spell out */
+        if (name[0] == '.' && (component->pattern[0] != '.' || !name[1] || (name[1] == '.' && !name[2])))
+          continue;
+
+        if (!component->globstar) {
+          nameLength = strlen(name);
+          if (nameLength < component->prefix + component->suffixLength
+              || memcmp(name, component->pattern, component->prefix) != 0
+              || memcmp(name + nameLength - component->suffixLength, component->suffix, component->suffixLength) != 0
+              || !globMatch(component->pattern, name))
+            continue;
+        }
+        else
+          nameLength = strlen(name);
+
+        pathAppend(walk, name, nameLength);
+        if (last)
+          addMatch(walk);
+        if (!last || component->globstar) {
+          /* '**' does not follow symlinks, other components do */
+          isDir = entry->d_type == DT_DIR;
+          if (entry->d_type == DT_UNKNOWN || (entry->d_type == DT_LNK && !component->globstar))
+            isDir = (component->globstar ? lstat(walk->path, &info) : stat(walk->path, &info)) == 0
+                    && S_ISDIR(info.st_mode);
+          if (isDir) {
+            pathAppend(walk, "/", 1);
+            walk->depth++;
+            globDirectory(walk, components, component->globstar ? i : i + 1, count);
+            walk->depth--;
+          }
+        }
+        walk->path[walk->length = base] = 0;
+      }
+    }
+    close(fd);
+}
+
+static int compareNames(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Expands one pattern, GLOB_PATTERN already skipped, into names (walk->count of them, pointing */
+/* into walk->names) */
+static char **globPattern(globWalk *walk, const char *pattern, int sorted)
+{
+    char *copy = strdup(pattern), *part, *next, **names;
+    globComponent *components;
+    int count = 0, literal = 1, i;
+    size_t offset;
+
+    components = (globComponent*) malloc((strlen(copy) / 2 + 2) * sizeof(globComponent));
+    part = copy;
+    if (*part == '/') {
+      pathAppend(walk, "/", 1);
+      part += strspn(part, "/");
+    }
+    /* A trailing '/' leaves an empty last component, which only keeps matches that are directories */
+    for (;;) {
+      next = strchr(part, '/');
+      if (next) {
+        *next = 0;
+        next += 1 + strspn(next + 1, "/");
+      }
+      setComponent(&components[count], part);
+      literal &= components[count++].literal;
+      if (!next)
+        break;
+      part = next;
+    }
+
+    if (!literal)
+      globDirectory(walk, components, 0, count);
+    for (i = 0; i < walk->depths; i++)
+      free(walk->batches[i]);
+
+    names = (char**) malloc((walk->count + 1) * sizeof(char*));
+    for (i = 0, offset = 0; i < walk->count; i++) {
+      names[i] = walk->names + offset;
+      offset += strlen(names[i]) + 1;
+    }
+    if (sorted)
+      qsort(names, walk->count, sizeof(char*), compareNames);
+
+    free(walk->batches);
+    free(components);
+    free(copy);
+    return names;
+}
+
+void expandCmdGlobs(cmdLine *pCmdLine, int sorted)
+{
+    globWalk walk;
+    char **names, *block;
+    int i, n;
+
+    for (; pCmdLine; pCmdLine = pCmdLine->next) {
+      for (i = 0; i < pCmdLine->argCount; i++) {
+        if (pCmdLine->arguments[i][0] != GLOB_PATTERN)
+          continue;
+
+        memset(&walk, 0, sizeof(walk));
+        names = globPattern(&walk, pCmdLine->arguments[i] + 1, sorted);
+        if (walk.count == 0) {
+          /* No match: the word itself, without the marker and the pattern escapes */
+          unescape((char*)pCmdLine->arguments[i]);
+          memmove(pCmdLine->arguments[i], pCmdLine->arguments[i] + 1, strlen(pCmdLine->arguments[i]));
+        }
+        else if (pCmdLine->arena) {
+          /* All the names in one arena allocation */
+          block = (char*) parserAlloc(pCmdLine->arena, walk.used, 0);
+          memcpy(block, walk.names, walk.used);
+          for (n = 0; n < walk.count; n++)
+            names[n] = block + (names[n] - walk.names);
+          spliceWords(pCmdLine, i, names, walk.count, 0);
+        }
+        else
+          spliceWords(pCmdLine, i, names, walk.count, 1);
+        i += walk.count ? walk.count - 1 : 0;
+
+        free(names);
+        free(walk.names);
+        free(walk.path);
+      }
+    }
+}
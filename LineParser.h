@@ -0,0 +1,90 @@
+typedef struct cmdArena cmdArena;
+
+/* A $(command) in an argument is kept as its command text between two of these markers, to be */
+/* run and replaced by the caller. Unquoted, its output is split into words; "$(command)" is one word, */
+/* as is any substitution in a redirection path, a '<<<' word or an assignment. */
+#define SUBST_BEGIN '\001'
+#define SUBST_QUOTED '\002'
+#define SUBST_END '\003'
+
+/* $? and $PIPESTATUS, unquoted or in double quotes, are replaced by one of these markers, for */
+/* the caller to replace with the status of the last pipeline or of each of its stages */
+#define STATUS_LAST '\005'
+#define STATUS_PIPE '\006'
+
+/* An argument with an unquoted '*', '?' or '[' starts with this marker, the rest of it being the */
+/* glob pattern, where the characters that were quoted or escaped are escaped with '\' */
+#define GLOB_PATTERN '\004'
+
+typedef struct cmdLine
+{
+    char * const *arguments; /* command line arguments (arg 0 is the command), NULL terminated */
+    int argCount;		/* number of arguments, not limited other than by memory */
+    char * const *assignments;	/* NAME=value words before the command, for its environment. NULL if none */
+    int assignmentCount;	/* number of assignments */
+    char const *inputRedirect;	/* input redirection path. NULL if no input redirection */
+    char const *outputRedirect;	/* output redirection path. NULL if no output redirection */
+    char const *hereData;	/* stdin contents given with '<<<' or '<<'. NULL if none */
+    char hereDoc;	/* boolean: hereData still holds the '<<' delimiter, the body has to be read */
+    char blocking;	/* boolean indicating blocking/non-blocking */
+    char fanout;	/* boolean: the stage starts a consumer of a fan-out, reading its own copy of the producer's output */
+    int idx;				/* index of current command in the chain of cmdLines (0 for the first) */
+    struct cmdLine *next;	/* next cmdLine in chain */
+    cmdArena *arena;	/* block holding the whole chain when parsed with parseCmdLinesArena, NULL otherwise */
+} cmdLine;
+
+/* How the next pipeline of a list runs */
+#define LIST_SEQ 0	/* ';', '&' or the end of the line: whatever this one returned */
+#define LIST_AND 1	/* '&&': only if this one succeeded */
+#define LIST_OR 2	/* '||': only if this one failed */
+
+typedef struct cmdList
+{
+    cmdLine *pipeline;	/* arena parsed pipeline, owned by the list until it is taken. NULL if empty or malformed (a syntax error) */
+    int connector;	/* LIST_SEQ, LIST_AND or LIST_OR */
+    const char *error;	/* what is wrong with the pipeline when it is NULL, a static string */
+    struct cmdList *next;	/* next pipeline in the list */
+} cmdList;
+
+/* Parses a given string to arguments and other indicators */
+/* Returns NULL when there's nothing to parse */ 
+/* When successful, returns a pointer to cmdLine (in case of a pipe, this will be the head of a linked list) */
+cmdLine *parseCmdLines(const char *strLine);	/* Parse string line */
+
+/* Same as parseCmdLines, but the chain and all of its strings are placed in one arena block */
+/* Only the head of such a chain may be passed to freeCmdLines, which then costs a single free */
+cmdLine *parseCmdLinesArena(const char *strLine);	/* Parse string line into an arena */
+
+/* Parses a whole command line of pipelines joined by ';', '&', '&&' and '||' */
+/* Returns NULL when there's nothing to parse */
+cmdList *parseCmdList(const char *strLine);
+
+/* Releases the list and the pipelines still in it */
+void freeCmdList(cmdList *list);
+
+/* Releases all allocated memory for the chain (linked list) */
+void freeCmdLines(cmdLine *pCmdLine);		/* Free parsed line */
+
+/* Replaces hereData with a copy of data, once the body of a '<<' here-doc is read */
+void replaceHereData(cmdLine *pCmdLine, const char *data);
+
+/* Replaces the input redirection path, or the output one if output is set, with a copy of path */
+void replaceRedirect(cmdLine *pCmdLine, int output, const char *path);
+
+/* Replaces arguments[num] with newString */
+/* Returns 0 if num is out-of-range, otherwise - returns 1 */
+int replaceCmdArg(cmdLine *pCmdLine, int num, const char *newString);
+
+/* Replaces assignments[num] with newString */
+/* Returns 0 if num is out-of-range, otherwise - returns 1 */
+int replaceCmdAssignment(cmdLine *pCmdLine, int num, const char *newString);
+
+/* Replaces arguments[num] with count words, none to remove it; the argument array grows as needed */
+/* Returns 0 if num is out-of-range, otherwise - returns 1 */
+int spliceCmdArgs(cmdLine *pCmdLine, int num, char * const *words, int count);
+
+/* Replaces every argument marked GLOB_PATTERN with the paths it matches: '*' and '?' match any */
+/* characters and any one character of a name, [...] one of a set, and a '**' component any */
+/* number of directories. The paths are sorted if sorted is set, in directory order otherwise. */
+/* A pattern that matches nothing stays as it is, without the marker and the escapes. */
+void expandCmdGlobs(cmdLine *pCmdLine, int sorted);
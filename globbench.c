@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <glob.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "LineParser.h"
+
+// Patterns timed in the benchmark directory: every name, one in two names, and a handful
+static const char *patterns[] = { "*", "*.log", "file00001*" };
+
+static double elapsedSeconds(struct timespec *start){
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Fill dir with count empty files, alternately named fileNNNNNNN.log and fileNNNNNNN.txt
+static void createFiles(const char *dir, long count){
+    char path[4096];
+    int fd;
+
+    if(mkdir(dir, 0755) == -1){
+        perror("mkdir failed");
+        exit(EXIT_FAILURE);
+    }
+    for(long i = 0; i < count; i++){
+        snprintf(path, sizeof(path), "%s/file%07ld.%s", dir, i, i % 2 ? "txt" : "log");
+        fd = open(path, O_CREAT | O_WRONLY, 0644);
+        if(fd == -1){
+            perror("open failed");
+            exit(EXIT_FAILURE);
+        }
+        close(fd);
+    }
+}
+
+static void runGlob(const char *pattern, int flags, const char *name){
+    struct timespec start;
+    glob_t result;
+    double seconds;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    glob(pattern, flags, NULL, &result);
+    seconds = elapsedSeconds(&start);
+    printf("  %-24s %8zu matches  %8.1f ms\n", name, result.gl_pathc, seconds * 1e3);
+    globfree(&result);
+}
+
+// The shell's path: parse the line, then expand its arguments
+static void runExpand(const char *pattern, int sorted, const char *name){
+    struct timespec start;
+    cmdLine *cmd;
+    char *line = (char*) malloc(strlen(pattern) + 6);
+    double seconds;
+
+    sprintf(line, "echo %s", pattern);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    cmd = parseCmdLinesArena(line);
+    expandCmdGlobs(cmd, sorted);
+    seconds = elapsedSeconds(&start);
+    printf("  %-24s %8d matches  %8.1f ms\n", name, cmd->argCount - 1, seconds * 1e3);
+    freeCmdLines(cmd);
+    free(line);
+}
+
+// Usage: globbench [directory] [files to create in it if it does not exist]
+int main(int argc, char**argv) {
+    const char *dir = argc > 1 ? argv[1] : "bench_glob";
+    long count = argc > 2 ? atol(argv[2]) : 1000000;
+    char pattern[4096];
+    struct stat info;
+    glob_t warm;
+
+    if(stat(dir, &info) == -1){
+        printf("creating %ld files in %s\n", count, dir);
+        createFiles(dir, count);
+    }
+
+    // Read the directory once untimed, so that every run finds it in the cache
+    snprintf(pattern, sizeof(pattern), "%s/*", dir);
+    glob(pattern, GLOB_NOSORT, NULL, &warm);
+    globfree(&warm);
+
+    for(int i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++){
+        snprintf(pattern, sizeof(pattern), "%s/%s", dir, patterns[i]);
+        printf("%s\n", pattern);
+        runGlob(pattern, 0, "glob()");
+        runGlob(pattern, GLOB_NOSORT, "glob(GLOB_NOSORT)");
+        runExpand(pattern, 1, "expandCmdGlobs");
+        runExpand(pattern, 0, "expandCmdGlobs unsorted");
+    }
+    return 0;
+}
@@ -1,99 +1,165 @@
+#define _GNU_SOURCE     // for F_SETPIPE_SZ
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
-
-int main(int argc, char**argv) {
-    int pipe_fd[2]; // pipe_fd[0] - read end, pipe_fd[1] - write end;
-
-    char *execute_ls[] = {"ls", "-ls", NULL};
-    char *execute_wc[] = {"wc", NULL};
-
-    pid_t pid1;
-    pid_t pid2;
-
-    // Create a pipe for communication between parent and child
-    if(pipe(pipe_fd) == -1){
-        perror("pipe failed");
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+// Pipe throughput benchmark: a producer writes the payload into a chain of pipes, relay stages
+// copy it along with read/write (as cat would) and the last stage reads and drops it.
+//
+// Usage: mypipeline [-b pipe_size] [-n payload] [-s stages] [-c chunk]
+//   -b  buffer size given to every pipe with F_SETPIPE_SZ (default: the kernel's)
+//   -n  bytes written by the producer (default 1G)
+//   -s  processes in the pipeline, producer and consumer included (default 2)
+//   -c  size of each read and write (default 64K)
+// Sizes take a K, M or G suffix.
+
+// Parsed into 64 bits, also with -m32, and rejected if it is over max
+static long long parseSize(const char *text, long long max){
+    char *end;
+    unsigned long long size;
+    int shift = 0;
+
+    errno = 0;
+    size = strtoull(text, &end, 10);
+    switch(*end){
+        case 'K': case 'k': shift = 10; end++; break;
+        case 'M': case 'm': shift = 20; end++; break;
+        case 'G': case 'g': shift = 30; end++; break;
+    }
+    if(!isdigit((unsigned char) text[0]) || *end != '\0' || errno == ERANGE || size > (unsigned long long) max >> shift){
+        fprintf(stderr, "invalid size %s\n", text);
         exit(EXIT_FAILURE);
     }
-
-    fprintf(stderr,"(parent_process>forking...)\n");
-
-    // Create a new process (child_1)
-    pid1 = fork();
-
-    // Child process 
-    if(pid1 == 0){
-
-        fprintf(stderr,"(child1>redirecting stdout to the write end of the pipe...)\n");
-
-
-        // Closes stdout
-        close(1);
-        dup(pipe_fd[1]);  // Redirect write_end to stdout 
-        close(pipe_fd[1]); // Close duplicated 
-        close(pipe_fd[0]); // Close read_end
-
-        fprintf(stderr,"(child1>going to execute cmd: ls -ls)\n");
-
-        if(execvp(execute_ls[0],execute_ls) == -1){
-            perror ("ls -ls failed");
-            _exit(1); // Exit immediately and safely - prevent duplicate or unintended output due to may sharr\ed buffers with parent 
+    return (long long) size << shift;
+}
+
+// Producer (in_fd -1): write payload bytes. Relay: copy in_fd to out_fd. Consumer (out_fd -1): drain in_fd.
+static void runStage(int in_fd, int out_fd, long long payload, char *buffer, long chunk){
+    ssize_t done, written;
+    long length;
+
+    if(in_fd == -1){
+        while(payload > 0){
+            length = payload < chunk ? payload : chunk;
+            done = write(out_fd, buffer, length);
+            if(done == -1){
+                perror("write failed");
+                _exit(1);
+            }
+            payload -= done;
         }
+        return;
     }
-    // Parent process
-    else if (pid1 > 0){
-        fprintf(stderr,"(parent_process>created process with id: %d)\n", pid1);
-        fprintf(stderr,"(parent_process>closing the write end of the pipe...)\n");
-
-        close(pipe_fd[1]); // Close write_end of pipe;
 
-        fprintf(stderr,"(parent_process>forking...)\n");
-
-        pid2 = fork();
-
-        // Child 2 fork faild
-        if(pid2 < 0){
-            perror("fork faild for child 2");
-            exit(EXIT_FAILURE);
+    while((done = read(in_fd, buffer, chunk)) > 0){
+        for(length = 0; out_fd != -1 && length < done; length += written){
+            written = write(out_fd, buffer + length, done - length);
+            if(written == -1){
+                perror("write failed");
+                _exit(1);
+            }
         }
+    }
+}
 
-        // Child 2
-        if(pid2 == 0){
+int main(int argc, char**argv) {
+    int pipe_fd[2]; // pipe_fd[0] - read end, pipe_fd[1] - write end;
+    int prev_read = -1, option, stages = 2;
+    long pipe_size = 0, chunk = 64 << 10;
+    long long payload = 1LL << 30;
+    char *buffer;
+    struct timespec start, end;
+    struct rusage usage;
+    double seconds;
+    pid_t pid;
+
+    while((option = getopt(argc, argv, "b:n:s:c:")) != -1){
+        switch(option){
+            case 'b': pipe_size = parseSize(optarg, INT_MAX); break; // F_SETPIPE_SZ takes an int
+            case 'n': payload = parseSize(optarg, LLONG_MAX); break;
+            case 's': stages = atoi(optarg); break;
+            case 'c': chunk = parseSize(optarg, LONG_MAX); break;
+            default:
+                fprintf(stderr, "usage: %s [-b pipe_size] [-n payload] [-s stages] [-c chunk]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if(stages < 2 || chunk <= 0){
+        fprintf(stderr, "need at least 2 stages and a positive chunk\n");
+        exit(EXIT_FAILURE);
+    }
 
-            fprintf(stderr,"(child2>redirecting stdin to the read end of the pipe...)\n");
+    buffer = (char*) malloc(chunk);
+    if(buffer == NULL){
+        perror("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    memset(buffer, 'x', chunk);
 
-            close(0); // close stdin
-            dup(pipe_fd[0]); // Redirect read_end to stdin 
-            close(pipe_fd[0]); // Close duplicated 
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(int i = 0; i < stages; i++){
+        pipe_fd[0] = pipe_fd[1] = -1;
 
-            fprintf(stderr,"(child2>going to execute cmd: wc)\n");
+        // Every stage but the last writes into a fresh pipe
+        if(i < stages - 1){
+            if(pipe(pipe_fd) == -1){
+                perror("pipe failed");
+                exit(EXIT_FAILURE);
+            }
+            if(pipe_size > 0 && fcntl(pipe_fd[1], F_SETPIPE_SZ, pipe_size) == -1){
+                perror("F_SETPIPE_SZ failed");
+                exit(EXIT_FAILURE);
+            }
+        }
 
-            if(execvp(execute_wc[0],execute_wc) == -1){
-                perror ("wc failed");
-                _exit(1); // Exit immediately and safely - prevent duplicate or unintended output due to may sharr\ed buffers with parent 
+        pid = fork();
+        if(pid == 0){
+            if(pipe_fd[0] != -1){
+                close(pipe_fd[0]); // Read end of the next stage
             }
+            runStage(prev_read, pipe_fd[1], payload, buffer, chunk);
+            _exit(0); // Exit immediately and safely - prevent duplicate or unintended output due to may shared buffers with parent
+        }
+        else if(pid < 0){
+            perror("fork failed");
+            exit(EXIT_FAILURE);
         }
 
-        // Parent here
+        // Parent keeps only the read end that feeds the next stage
+        if(prev_read != -1){
+            close(prev_read);
+        }
+        if(pipe_fd[1] != -1){
+            close(pipe_fd[1]);
+        }
+        prev_read = pipe_fd[0];
+    }
 
-        fprintf(stderr, "(parent_process>created process with id: %d)\n",pid2);
-        fprintf(stderr,"(parent_process>closing the read end of the pipe...)\n");
+    while(wait(NULL) > 0); // Wait for every stage to finish
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    getrusage(RUSAGE_CHILDREN, &usage);
 
+    // The size the pipes really had, as rounded by the kernel
+    if(pipe(pipe_fd) == 0){
+        if(pipe_size > 0){
+            fcntl(pipe_fd[1], F_SETPIPE_SZ, pipe_size);
+        }
+        pipe_size = fcntl(pipe_fd[1], F_GETPIPE_SZ);
         close(pipe_fd[0]);
-
-        fprintf(stderr, "(parent_process>waiting for child processes to terminate...)\n");
-
-        waitpid(pid1,NULL,0); // Wait for child1 process to finish 
-        waitpid(pid2,NULL,0); // Wait for child2 process to finish 
-
-        fprintf(stderr, "(parent_process>exiting...)\n");
-    }
-    // fork failed 
-    else{
-        perror("fork failed for child 1");
-        exit(EXIT_FAILURE);
+        close(pipe_fd[1]);
     }
+    seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("pipe %7ldK  %d stages  %lld bytes in %ldK chunks: %.3f s  %8.1f MB/s  %ld context switches\n",
+           pipe_size >> 10, stages, payload, chunk >> 10, seconds, payload / seconds / 1e6,
+           usage.ru_nvcsw + usage.ru_nivcsw);
+    free(buffer);
     return 0;
-}
\ No newline at end of file
+}
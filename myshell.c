@@ -1,585 +1,4129 @@
-#include <unistd.h>     // for fork, execvp, chdir, getcwd, dup2, close
+#define _GNU_SOURCE     // for pipe2 and memfd_create
+#include <unistd.h>     // for fork, execvp, chdir, getcwd, dup2, close, setpgid, tcsetpgrp
 #include <linux/limits.h>     // for PATH_MAX
-#include <stdio.h>      // for printf, perror, fgets
+#include <stdio.h>      // for printf, perror, getline
 #include <stdlib.h>     // for exit, malloc, free, atoi
-#include <string.h>     // for strcmp, strncmp, strlen, strcpy
+#include <string.h>     // for strcmp, strncmp, strlen, strdup
 #include <sys/types.h>  // for pid_t
-#include <sys/wait.h>   // for waitpid
+#include <sys/wait.h>   // for waitpid, wait4
 #include <fcntl.h>      // for open
-#include <signal.h>     // for kill, signal
+#include <signal.h>     // for kill, killpg, signal
 #include "LineParser.h" // for parseCmdLines and cmdLine struct
 #include <errno.h>
+#include <spawn.h>      // for posix_spawnp and its file actions
+#include <time.h>       // for clock_gettime
+#include <poll.h>       // for poll
+#include <sys/epoll.h>  // for epoll_create1, epoll_ctl, epoll_wait
+#include <sys/syscall.h> // for SYS_pidfd_open
+#include <sys/stat.h>   // for stat
+#include <sys/mman.h>   // for mmap, memfd_create
+#include <sys/resource.h> // for setpriority, getrusage, struct rusage
+#include <linux/perf_event.h> // for struct perf_event_attr
+#include <pthread.h>    // for the history writer thread
+#include <termios.h>    // for the raw mode of the line editor
+#include <dirent.h>     // for opendir, to list the descriptors of a forked child
+#include <ctype.h>      // for isalpha, isalnum, isdigit
+#include <limits.h>     // for ULLONG_MAX
+
+extern char **environ;
 
 int debug_mode = 0;
+int fork_backend = 0;           // -f: launch with fork()+execvp instead of posix_spawn
+int interactive = 0;            // Reading commands from a terminal: prompt, history and Done notices
+int job_control = 0;            // The shell owns the terminal: foreground jobs get it, ^Z stops them
+pid_t shell_pgid = 0;           // Process group of the shell, given the terminal back after each foreground job
+int errexit = 0;                // set -e: stop at the first command that fails
+long spawn_count = 0;           // Number of launches, for the debug spawn latency summary
+long long spawn_total_ns = 0;   // Time the shell spent inside the launcher
+int launch_nice = 0;            // Nice value spawnCommand applies to what it launches, set by 'prio'
+int launch_profile = 0;         // spawnCommand attaches perf counters to what it launches, set by 'profile'
+int launch_status = 127;        // Status of the last command that could not be launched: 1 for a failed redirection, else 127
+int max_jobs = 0;               // set maxjobs=N: running processes before '&' jobs are queued, 0 for no limit
+long pipe_size = 0;             // set pipesz=SIZE: buffer size of the pipes between stages, 0 for the kernel default
+long launch_pipe_size = 0;      // Pipe buffer size of the job being launched, set by 'pipesz' or from pipe_size
+int glob_sort = 1;              // set globsort=0: leave glob matches in directory order, for huge directories
 
 #define TERMINATED -1
 #define RUNNING 1
 #define SUSPENDED 0
-#define HISTLEN 20
+#define QUEUED 2
+#define HISTSIZE_DEFAULT 1000  // History lines kept when $HISTSIZE is not set
+#define HERE_MEMFD_MAX (1 << 20) // Larger here-docs are streamed through a pipe instead of a memfd
+
+#define TERMINATED_CAP 1024  // Terminated records kept for 'procs' before the oldest are dropped
+
+#define PERF_COUNTERS 5
+
+// perf_event_open counters attached to a profiled process. They follow its children (inherit)
+// and only start counting at exec (enable_on_exec), so the shell's own work is left out.
+typedef struct perf_sample{
+    int hardware;                         /* 1 for the PMU counters, 0 for the software fallback */
+    int fds[PERF_COUNTERS];               /* counter file descriptors, -1 once read */
+    long long values[PERF_COUNTERS];      /* counts scaled for multiplexing, -1 if not available */
+} perf_sample;
+
+// Set by spawnCommand for a profiled launch, taken over by the addProcess call that follows
+perf_sample *pending_sample = NULL;
 
 typedef struct process{
-    cmdLine* cmd;                         /* the parsed command line*/
+    char *command;                        /* the command together with its arguments */
     pid_t pid; 		                  /* the process id that is running the command*/
+    pid_t pgid;                           /* process group of its job (pid of the first stage), 0 if it stayed in the shell's */
     int status;                           /* status of the process: RUNNING/SUSPENDED/TERMINATED */
-    struct process *next;	                  /* next process in chain */
+    int exit_status;                      /* exit code (128+signal if killed) once TERMINATED, -1 if unknown */
+    long long start_ns;                   /* CLOCK_MONOTONIC time the process was launched */
+    long long end_ns;                     /* CLOCK_MONOTONIC time it was reaped, 0 until then */
+    struct timeval user_time;             /* CPU time from its rusage, once reaped */
+    struct timeval sys_time;
+    long max_rss;                         /* peak resident set size in KiB */
+    long voluntary_switches;              /* context switches: blocked waiting, and preempted */
+    long involuntary_switches;
+    perf_sample *sample;                  /* counters of 'profile', NULL when not profiled */
 } process;
 
+// Processes are kept in a dense array in launch order, indexed by pid through an open addressing
+// hash table, so status updates and reaping do not have to scan every tracked process.
+typedef struct process_table{
+    process *procs;                       /* records, oldest first */
+    int count;                            /* number of records in procs */
+    int capacity;                         /* allocated size of procs */
+    int *index;                           /* pid hash: position in procs, or -1 for an empty slot */
+    int index_size;                       /* number of hash slots, a power of two */
+    int terminated;                       /* number of records with TERMINATED status */
+    int running;                          /* number of records with RUNNING status */
+} process_table;
+
 // Global variable
-process *process_list = NULL;
-
-typedef struct terminal_command{
-    char * input_command;  
-    struct terminal_command *next;                          	                  
-} terminal_command;
-
-terminal_command *history_head = NULL;
-terminal_command *history_tail = NULL;
-int history_size = 0;
-
-void addProcess(process** process_list, cmdLine* cmd, pid_t pid,int status);
-void freeProcessList(process* process_list);
-void updateProcessList(process **process_list);
-void updateProcessStatus(process* process_list, int pid, int status);
-void printProcessList(process** process_list);
+process_table process_list = {NULL, 0, 0, NULL, 0, 0, 0};
+
+// A background job held back by 'set maxjobs', launched as is once it is admitted
+typedef struct queued_job{
+    cmdLine *cmd;                         /* the parsed job, owned by the queue until launch */
+    char *command;                        /* text shown by procs */
+    int priority;                         /* nice value applied at launch, lower values are admitted first */
+    int profile;                          /* launch under perf counters */
+    long pipe_size;                       /* pipesz override, 0 to follow 'set pipesz' */
+    long seq;                             /* submission order, breaks ties between equal priorities */
+} queued_job;
+
+// Binary min-heap on (priority, seq)
+typedef struct job_queue{
+    queued_job *jobs;
+    int count;
+    int capacity;
+    long next_seq;
+} job_queue;
+
+job_queue queued_jobs = {NULL, 0, 0, 0};
+
+#define PATH_CACHE_BUCKETS 256
+
+// Resolved $PATH location of a command name, so launches skip the execvp directory walk
+typedef struct path_entry{
+    char *name;                           /* the command name as typed */
+    char *path;                           /* full path it resolved to */
+    int hits;                             /* launches served from the cache */
+    int dir_index;                        /* position of its directory in $PATH */
+    struct path_entry *next;              /* next entry in the bucket */
+} path_entry;
+
+path_entry *path_cache[PATH_CACHE_BUCKETS];
+char *path_cache_env = NULL;              // $PATH the cache was built for
+long path_lookup_syscalls = 0;            // stat calls made resolving commands
+long path_execvp_syscalls = 0;            // execve calls execvp would have made for the same launches
+
+// environ indexed by variable name, so that the NAME=value assignments of a job find the entry
+// they override without a scan of the whole environment. Dropped when export or unset change it.
+typedef struct env_index{
+    char **envp;                          /* environ the index was built for, NULL when stale */
+    int count;                            /* variables in envp */
+    int *slots;                           /* open addressing table of positions in envp, -1 if free */
+    int size;                             /* slots, a power of two above twice count */
+} env_index;
+
+env_index shell_env = {NULL, 0, NULL, 0};
+char **shell_vars = NULL;                 // NAME=value of the variables assigned but not exported
+int shell_var_count = 0;
+int shell_var_capacity = 0;
+
+// Exit status of the last foreground command or of the last process joined by 'wait'
+int last_status = 0;
+// Reads the line after the one runLine is running, for the body of a here-doc: from the
+// terminal, stdin or the script, whichever the line came from. -1 at the end of the input.
+ssize_t (*read_more)(char **line, size_t *capacity) = NULL;
+int *pipe_status = NULL;        // $PIPESTATUS: status of each stage of the last foreground pipeline
+int pipe_status_count = 0;
+int pipe_status_capacity = 0;
+
+// SIGCHLD only writes a byte to this pipe; the shell reaps from its main loop
+int sigchld_pipe[2] = {-1, -1};
+
+// Background processes that terminated since the last prompt, reported as "Done"
+typedef struct done_notice{
+    pid_t pid;
+    int exit_status;
+    char *command;
+} done_notice;
+
+done_notice *done_list = NULL;
+int done_count = 0;
+int done_capacity = 0;
+
+typedef struct history_entry{
+    const char *text;                     /* the line, newline included; not NUL terminated when it lies in the file mapping */
+    int length;
+    int owned;                            /* text was allocated by addHistory, not mapped from $HISTFILE */
+} history_entry;
+
+// The last $HISTSIZE lines in a ring, numbered from 1 for the oldest one kept, so !n and !! are O(1)
+typedef struct history_ring{
+    history_entry *entries;
+    int capacity;
+    int size;                             /* entries in use */
+    int head;                             /* position of the oldest entry */
+    unsigned int evicted;                 /* lines dropped so far; line n is number evicted + n - 1 of the session */
+    char *map;                            /* $HISTFILE as it was at startup, loaded entries point into it */
+    size_t map_size;
+} history_ring;
+
+history_ring history = {NULL, 0, 0, 0, 0, NULL, 0};
+
+// Lines of the session (numbered as in history_ring.evicted) containing one trigram, oldest first.
+// Numbers of lines that left the ring are trimmed from the front lazily.
+typedef struct trigram_postings{
+    unsigned int trigram;                 /* three bytes of a line, 0 for an empty slot */
+    unsigned int *lines;
+    int start;                            /* first entry still in the ring */
+    int count;
+    int capacity;
+} trigram_postings;
+
+// Trigram index over the history, for hist grep, hist -n and ^R. Built on the first search and
+// kept up to date by addHistory from then on.
+typedef struct history_index{
+    trigram_postings *slots;              /* open addressing on the trigram */
+    int slot_count;                       /* a power of two */
+    int used;
+    int built;
+} history_index;
+
+history_index history_search = {NULL, 0, 0, 0};
+
+// New lines are appended to $HISTFILE by a writer thread, so a slow disk never delays the prompt
+typedef struct history_writer{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    char *pending;                        /* lines not written yet */
+    size_t length;
+    size_t capacity;
+    int fd;                               /* $HISTFILE opened for appending, -1 when history is not saved */
+    int stop;                             /* set by quit: write what is pending, then exit */
+} history_writer;
+
+history_writer history_file = {0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, 0, -1, 0};
+
+void addProcess(process_table* process_list, cmdLine* cmd, pid_t pid, pid_t pgid, int status);
+void freeProcessList(process_table* process_list);
+void updateProcessList(process_table* process_list);
+void updateProcessStatus(process_table* process_list, int pid, int status);
+void printProcessList(process_table* process_list);
+void printProcessTableMemory(process_table* process_list);
+void installSigchldHandler();
+void reapChildren();
+void printDoneNotices();
+void setProcessExitStatus(process_table* process_list, pid_t pid, int wait_status, const struct rusage *usage);
+void waitProcesses(cmdLine *pCmdLine);
+void parallelCommand(cmdLine *pCmdLine);
+void queueJob(cmdLine *pCmd, int priority, int profile, long pipe_size);
+void dispatchQueuedJobs();
+void freeJobQueue();
+void drainJobQueue();
 void executePipeCommand(cmdLine *pCmd);
+void printJobs();
+void continueJob(cmdLine *pCmdLine, int foreground);
+pid_t spawnCommand(cmdLine *pCmdLine, int in_fd, int out_fd, pid_t pgid);
+const char *resolveCommand(const char *name);
+void forgetCommand(const char *name);
+void clearPathCache();
+void hashCommand(cmdLine *pCmdLine);
 void execute(cmdLine *pCmdLine);
+int runLine(char *input);
+int runString(const char *commands);
+int runScript(const char *path);
+void initHistory();
 void addHistory(const char *terminal_cmd);
 void printHistory();
-const char *print_n_Command(int n);
+const history_entry *print_n_Command(int n);
+void searchHistory(const char *pattern, int prefix);
 
 
 
 
-// Receive a process list (process_list), a command (cmd), and the process id (pid) of the process running the command
-void addProcess(process** process_list, cmdLine* cmd, pid_t pid, int status){
-    process *new_process = (process*) malloc(sizeof(process));
-    new_process -> cmd = cmd;
-    new_process -> pid = pid;
-    new_process -> status = status;
-    new_process -> next = *process_list;
-    *process_list = new_process;
+static long long monotonicNs(){
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
 }
 
-// <index in process list> <process id> <process status> <the command together with its arguments>
-void printProcessList(process** process_list){
-    int index = 0;
-    char *status;
+// Counters of 'profile': the PMU set, and the software set used when the PMU is not available (VMs, containers)
+static const struct perf_counter{
+    unsigned int type;
+    unsigned long long config;
+} perf_counters[2][PERF_COUNTERS] = {
+    {{PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK}, {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+     {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES}, {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS},
+     {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MAJ}},
+    {{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES}, {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+     {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES}, {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+     {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS}},
+};
 
-    updateProcessList(process_list);
-    // Print format
-    printf("Index\tPID\tSTATUS\tCOMMAND\n");
-
-    process *current = *process_list;
-    process *prev = NULL;
-    process *remove_process = NULL;
-
-    while(current != NULL){
-        status = current->status == RUNNING ? "Running":
-                current->status == SUSPENDED ? "Suspended":
-                "Terminated";
-        printf("%d\t%d\t%s\t",index++,current->pid,status);
-        // Print command together with its arguments
-        for(int i=0; i < current->cmd->argCount; i++){
-            printf("%s ", current->cmd->arguments[i]);
-        }
-        printf("\n"); // For next process
-        if (current->status == TERMINATED){
-            remove_process = current;
-            // First process in process list; 
-            if(prev == NULL){
-                *process_list = current->next;
-            }
-            else{
-                prev->next = current->next;
-            }
-            current = current -> next;
-            if (remove_process -> cmd != NULL){
-                remove_process -> cmd -> next = NULL;
+static int openCounterSet(perf_sample *sample, pid_t pid, int user_only){
+    struct perf_event_attr attr;
+
+    for(int i = 0; i < PERF_COUNTERS; i++){
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = perf_counters[sample->hardware][i].type;
+        attr.config = perf_counters[sample->hardware][i].config;
+        attr.disabled = 1;
+        attr.enable_on_exec = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = user_only;
+        attr.exclude_hv = user_only;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        sample->fds[i] = syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        if(sample->fds[i] == -1){
+            while(--i >= 0){
+                close(sample->fds[i]);
             }
-            remove_process -> next = NULL;
-            freeCmdLines(remove_process->cmd);
-            free(remove_process);
-        }
-        else{
-            prev = current;
-            current = current -> next;
+            return 0;
         }
     }
+    return 1;
 }
 
-//  Free all memory allocated for the process list.
-void freeProcessList(process* process_list){
-    process *current = process_list;
-    process *next = NULL;
+// Attach counters to a child that has not called exec yet
+static perf_sample *openCounters(pid_t pid){
+    perf_sample *sample = (perf_sample*) malloc(sizeof(perf_sample));
 
-    while(current != NULL){
-        next = current->next;
-        freeCmdLines(current->cmd);
-        current->next = NULL;
-        free(current);
-        current = next;
+    if(sample == NULL){
+        perror("malloc failed");
+        exit(1);
+    }
+    // Kernel time is counted when perf_event_paranoid allows it, user space only otherwise
+    for(sample->hardware = 1; sample->hardware >= 0; sample->hardware--){
+        if(openCounterSet(sample, pid, 0) || openCounterSet(sample, pid, 1)){
+            return sample;
+        }
     }
+    perror("profile: perf_event_open failed");
+    free(sample);
+    return NULL;
 }
 
-// Go over the process list, and for each process check if it is done.
-void updateProcessList(process **process_list){
-    int status;
-    process *current = *process_list;
-    pid_t pid;
-
-    while(current != NULL){
-        // If the child pid changed status waitpid returns its PID.
-        // If the child has not exited yet, it returns 0 immediately.
-        // If there’s an error (e.g., no such child), it returns -1.
-
-        // WNOHANG - Don't block (wait) if no child process has exited. Just return immediately.
-        //  &status saves details on termination of the child 
-        pid = waitpid(current->pid, &status, WNOHANG);
+// Read the final counts once the process has been reaped. Counts of its exited children are included.
+static void readCounters(perf_sample *sample){
+    unsigned long long data[3]; // value, time enabled, time running
 
-        // If the child pid changed status waitpid returns its PID
-        if (pid > 0){
-            //  WIFEXITED &  WIFSIGNALED - returns true if the child terminated
-            if (WIFEXITED(status) || WIFSIGNALED(status)){
-                current->status = TERMINATED;
-            }
-            // WIFSTOPPED - returns  true  if the child process was stopped by delivery of a signal;
-            else if (WIFSTOPPED(status)){
-                current->status = SUSPENDED;
-            }
-            // WIFCONTINUED - return if a stopped child has been resumed by delivery of SIGCONT
-            else if (WIFCONTINUED(status)){
-                current->status = RUNNING;
-            }
+    for(int i = 0; i < PERF_COUNTERS; i++){
+        sample->values[i] = -1;
+        if(sample->fds[i] == -1){
+            continue;
         }
-        // If there’s an error (e.g., no such child), it returns -1.
-        else if (pid == -1){
-            if (errno == ECHILD){
-                current->status = TERMINATED;
-            }
+        if(read(sample->fds[i], data, sizeof(data)) == sizeof(data)){
+            // Scale up when the PMU was shared with other counters
+            sample->values[i] = data[2] == 0 ? 0 : data[2] < data[1] ? (long long)((double)data[0] * data[1] / data[2]) : (long long)data[0];
         }
-        current = current -> next;
+        close(sample->fds[i]);
+        sample->fds[i] = -1;
     }
-
 }
 
-// Find the process with the given id in the process_list and change its status to the received status.
-void updateProcessStatus(process* process_list, int pid, int status){
-    process *current = process_list;
-    
-    while(current != NULL){
-        if (current->pid == pid){
-            current ->status = status;
-            return;
+static void freeSample(perf_sample *sample){
+    if(sample == NULL){
+        return;
+    }
+    for(int i = 0; i < PERF_COUNTERS; i++){
+        if(sample->fds[i] != -1){
+            close(sample->fds[i]);
         }
-        current = current -> next;
     }
+    free(sample);
 }
 
-void wakeupProcess(pid_t process_id){
-    if(kill(process_id, SIGCONT) == -1){
-        fprintf(stderr, "%d wakeup failed\n", process_id);
+// One line summary: IPC and misses per thousand instructions, or the software counts
+static void formatSample(const perf_sample *sample, char *text, size_t size){
+    const long long *v = sample->values;
+
+    if(sample->hardware){
+        snprintf(text, size, "%lld cycles, %lld instructions, %.2f IPC, %.2f cache-misses/kinstr, "
+                 "%.2f branch-misses/kinstr, %lld page-faults",
+                 v[0], v[1], v[0] > 0 ? (double)v[1] / v[0] : 0.0,
+                 v[1] > 0 ? 1000.0 * v[2] / v[1] : 0.0, v[1] > 0 ? 1000.0 * v[3] / v[1] : 0.0, v[4]);
     }
-    else {
-        fprintf(stderr, "Send signal wakeup to process %d\n", process_id);
-        updateProcessStatus(process_list, process_id, RUNNING);
+    else{
+        snprintf(text, size, "%.3f ms task-clock, %lld page-faults, %lld context-switches, "
+                 "%lld cpu-migrations, %lld major-faults (software counters)",
+                 v[0] / 1e6, v[1], v[2], v[3], v[4]);
     }
 }
 
-void haltProcess(pid_t process_id){
-    if(kill(process_id,SIGSTOP) == -1){
-        fprintf(stderr, "%d halt failed\n", process_id);
+static unsigned int pidHash(pid_t pid, int index_size){
+    return ((unsigned int)pid * 2654435761u) & (index_size - 1);
+}
+
+// Return the position of the newest record of pid in the table, or -1 if it is not tracked
+static int findProcess(process_table* process_list, pid_t pid){
+    unsigned int slot;
+    int pos;
+
+    if(process_list->index_size == 0){
+        return -1;
     }
-    else {
-        fprintf(stderr, "Send signal halt to process %d\n", process_id);
-        updateProcessStatus(process_list, process_id, SUSPENDED);
+    for(slot = pidHash(pid, process_list->index_size); (pos = process_list->index[slot]) != -1;
+        slot = (slot + 1) & (process_list->index_size - 1)){
+        if(process_list->procs[pos].pid == pid){
+            return pos;
+        }
     }
+    return -1;
 }
 
-void iceProcess(pid_t process_id){
-    if(kill(process_id, SIGINT) == -1){
-        fprintf(stderr, "%d ice failed", process_id);
-    }
-    else {
-        fprintf(stderr, "Send signal ice to process %d\n", process_id);
-        updateProcessStatus(process_list, process_id, TERMINATED);
+// Point the hash slot of procs[pos].pid at pos, replacing an older record of a reused pid
+static void indexProcess(process_table* process_list, int pos){
+    unsigned int slot = pidHash(process_list->procs[pos].pid, process_list->index_size);
+
+    while(process_list->index[slot] != -1 && process_list->procs[process_list->index[slot]].pid != process_list->procs[pos].pid){
+        slot = (slot + 1) & (process_list->index_size - 1);
     }
+    process_list->index[slot] = pos;
 }
 
-void executePipeCommand(cmdLine *pCmd){
-    int pipe_fd[2]; // pipe_fd[0] - read end, pipe_fd[1] - write end;
-    int in_fd, out_fd;
-    char* const* execute_first_cmd = pCmd->arguments;
-    char* const* execute_second_cmd = pCmd->next->arguments;
+// Rebuild the pid hash over the current records, with at least twice as many slots as records
+static void rebuildProcessIndex(process_table* process_list){
+    int size = process_list->index_size ? process_list->index_size : 64;
+
+    while(size < 2 * process_list->capacity){
+        size *= 2;
+    }
+    if(size != process_list->index_size){
+        free(process_list->index);
+        process_list->index = (int*) malloc(size * sizeof(int));
+        if(process_list->index == NULL){
+            perror("malloc failed");
+            exit(1);
+        }
+        process_list->index_size = size;
+    }
+    memset(process_list->index, -1, size * sizeof(int));
+    for(int pos = 0; pos < process_list->count; pos++){
+        indexProcess(process_list, pos);
+    }
+}
 
-    pid_t pid1;
-    pid_t pid2;
+// Drop terminated records, oldest first, until at most keep of them are left
+static void compactProcessTable(process_table* process_list, int keep){
+    int drop = process_list->terminated - keep;
+    int pos, kept = 0;
 
-    if(pCmd -> outputRedirect != NULL || pCmd-> next -> inputRedirect != NULL){
-        perror("Error: cannot redirect left-side output or right-side input in a pipe\n");
-        freeCmdLines(pCmd);
+    if(drop <= 0){
         return;
     }
-
-    // Create a pipe for communication between parent and child
-    if(pipe(pipe_fd) == -1){
-        perror("pipe failed\n");
-        freeCmdLines(pCmd);
-        exit(EXIT_FAILURE);
+    for(pos = 0; pos < process_list->count; pos++){
+        if(drop > 0 && process_list->procs[pos].status == TERMINATED){
+            free(process_list->procs[pos].command);
+            freeSample(process_list->procs[pos].sample);
+            drop--;
+            process_list->terminated--;
+        }
+        else{
+            process_list->procs[kept++] = process_list->procs[pos];
+        }
     }
+    process_list->count = kept;
 
-    // Create a new process (child_1)
-    pid1 = fork();
+    // Give back memory once the table is mostly empty
+    if(process_list->capacity > 64 && process_list->count < process_list->capacity / 4){
+        while(process_list->capacity > 64 && process_list->count < process_list->capacity / 4){
+            process_list->capacity /= 2;
+        }
+        process_list->procs = (process*) realloc(process_list->procs, process_list->capacity * sizeof(process));
+        free(process_list->index);
+        process_list->index = NULL;
+        process_list->index_size = 0;
+    }
+    rebuildProcessIndex(process_list);
+}
 
-    // Child process 
-    if(pid1 == 0){
+static void setProcessStatus(process_table* process_list, int pos, int status){
+    if(process_list->procs[pos].status == TERMINATED){
+        process_list->terminated--;
+    }
+    else if(process_list->procs[pos].status == RUNNING){
+        process_list->running--;
+    }
+    if(status == TERMINATED){
+        process_list->terminated++;
+    }
+    else if(status == RUNNING){
+        process_list->running++;
+    }
+    process_list->procs[pos].status = status;
+}
 
-        // Closes stdout
-        close(1);
-        dup(pipe_fd[1]);  // Redirect write_end to stdout 
-        close(pipe_fd[1]); // Close duplicated 
-        close(pipe_fd[0]); // Close read_end
+// Receive a process table (process_list), a command (cmd), and the process id (pid) of the process running the command.
+// Only the command text is kept, the caller still owns cmd.
+void addProcess(process_table* process_list, cmdLine* cmd, pid_t pid, pid_t pgid, int status){
+    process *new_process;
+    size_t length = 0;
+    char *text;
 
-        if(pCmd->inputRedirect != NULL){
-            in_fd = open(pCmd-> inputRedirect,O_RDONLY);
-            if (in_fd < 0){ // Error in opening file
-                fprintf(stderr, "Could not input Redirect from %s\n", pCmd->inputRedirect);
-                freeCmdLines(pCmd);
-               _exit(1); 
-            }
-            dup2(in_fd,0); // Replace stdin with in_fd
-            close(in_fd);
+    if(process_list->count == process_list->capacity){
+        process_list->capacity = process_list->capacity ? 2 * process_list->capacity : 64;
+        process_list->procs = (process*) realloc(process_list->procs, process_list->capacity * sizeof(process));
+        if(process_list->procs == NULL){
+            perror("malloc failed");
+            exit(1);
         }
+        rebuildProcessIndex(process_list);
+    }
 
-        if(execvp((const char*)execute_first_cmd[0],(char* const*)execute_first_cmd) == -1){
-            perror ("first command failed\n");
-            freeCmdLines(pCmd);
-            _exit(1); // Exit immediately and safely - prevent duplicate or unintended output due to may sharr\ed buffers with parent 
-        }
+    for(int i=0; i < cmd->argCount; i++){
+        length += strlen(cmd->arguments[i]) + 1;
+    }
+    text = (char*) malloc(length + 1);
+    if(text == NULL){
+        perror("malloc failed");
+        exit(1);
+    }
+    text[0] = '\0';
+    for(int i=0, offset=0; i < cmd->argCount; i++){
+        offset += sprintf(text + offset, "%s ", cmd->arguments[i]);
     }
 
-    // Parent process
-    else if (pid1 > 0){
+    new_process = &process_list->procs[process_list->count];
+    memset(new_process, 0, sizeof(process));
+    new_process -> command = text;
+    new_process -> start_ns = monotonicNs();
+    new_process -> sample = pending_sample;
+    pending_sample = NULL;
+    new_process -> pid = pid;
+    new_process -> pgid = pgid;
+    new_process -> status = RUNNING;
+    new_process -> exit_status = -1;
+    process_list->running++;
+    indexProcess(process_list, process_list->count++);
+    setProcessStatus(process_list, process_list->count - 1, status);
 
-        close(pipe_fd[1]); // Close write_end of pipe;
+    // Keep the memory of long running shells bounded
+    if(process_list->terminated > TERMINATED_CAP){
+        compactProcessTable(process_list, TERMINATED_CAP / 2);
+    }
+}
 
-        pid2 = fork();
+static const char *statusName(int status){
+    return status == RUNNING ? "Running":
+           status == SUSPENDED ? "Suspended":
+           status == QUEUED ? "Queued":
+           "Terminated";
+}
 
-        // Child 2 fork faild
-        if(pid2 < 0){
-            perror("fork faild for child 2\n");
-            freeCmdLines(pCmd);
-            exit(EXIT_FAILURE);
-        }
+static int compareQueuedJobs(const void *a, const void *b){
+    const queued_job *first = *(const queued_job**)a, *second = *(const queued_job**)b;
 
-        // Child 2
-        if(pid2 == 0){
+    if(first->priority != second->priority){
+        return first->priority < second->priority ? -1 : 1;
+    }
+    return first->seq < second->seq ? -1 : first->seq > second->seq;
+}
 
-            close(0); // close stdin
-            dup(pipe_fd[0]); // Redirect read_end to stdin 
-            close(pipe_fd[0]); // Close duplicated 
+// <index in process list> <process id> <process status> <the command together with its arguments>
+void printProcessList(process_table* process_list){
+    int index = 0;
+    queued_job **order;
 
-            if(pCmd->next -> outputRedirect != NULL){
-            // 0 - for base octal, 6 - rw user, 4 - read group, 4 - read other
-            out_fd = open(pCmd-> next -> outputRedirect, O_WRONLY | O_CREAT | O_TRUNC, 0644); // O_WRONLY - write only, O_CREAT - create file if not exist, O_TRUNC - delete current input given file 
-            if (out_fd < 0){ // Error in opening file
-                fprintf(stderr, "Could not output Redirect from %s\n",pCmd-> next ->outputRedirect);
-                freeCmdLines(pCmd);
-               _exit(1); 
-            }
-            dup2(out_fd,1); // Replace stdout with in_fd
-            close(out_fd);
-        }
+    updateProcessList(process_list);
+    // Print format. WALL, USER and SYS are in seconds, MAXRSS in KiB, CSW are voluntary/involuntary
+    // context switches; resource usage is known once the process has been reaped.
+    printf("Index\tPID\tSTATUS\t\tWALL\tUSER\tSYS\tMAXRSS\tCSW\tCOMMAND\n");
 
-            if(execvp((const char*)execute_second_cmd[0],(char* const*)execute_second_cmd) == -1){
-                perror ("second command failed\n");
-                freeCmdLines(pCmd);
-                _exit(1); // Exit immediately and safely - prevent duplicate or unintended output due to may sharr\ed buffers with parent 
-            }
+    // Queued jobs have no pid yet, they are listed in the order they will be admitted
+    if(queued_jobs.count > 0){
+        order = (queued_job**) malloc(queued_jobs.count * sizeof(queued_job*));
+        if(order == NULL){
+            perror("malloc failed");
+            exit(1);
         }
-
-        // Parent here
-
-        close(pipe_fd[0]);
-
-        if(pCmd->blocking){
-            addProcess(&process_list, pCmd, pid1 ,RUNNING); // Terminated  
-            waitpid(pid1,NULL,0); // Wait for child1 process to finish 
+        for(int i = 0; i < queued_jobs.count; i++){
+            order[i] = &queued_jobs.jobs[i];
         }
-        else{
-            addProcess(&process_list, pCmd, pid1 ,RUNNING); // Terminated  
+        qsort(order, queued_jobs.count, sizeof(queued_job*), compareQueuedJobs);
+        for(int i = 0; i < queued_jobs.count; i++){
+            printf("%d\t-\t%-10s\t-\t-\t-\t-\t-\t%s\n", index++, statusName(QUEUED), order[i]->command);
         }
-        
-        if(pCmd->next->blocking){
-            addProcess(&process_list, pCmd->next, pid2 ,TERMINATED); // Terminated 
-            waitpid(pid2,NULL,0); // Wait for child2 process to finish  
+        free(order);
+    }
+
+    // Newest process first
+    for(int pos = process_list->count - 1; pos >= 0; pos--){
+        process *current = &process_list->procs[pos];
+        printf("%d\t%d\t%-10s\t",index++,current->pid,statusName(current->status));
+        if(current->end_ns != 0){
+            printf("%.3f\t%.3f\t%.3f\t%ld\t%ld/%ld\t",
+                   (current->end_ns - current->start_ns) / 1e9,
+                   current->user_time.tv_sec + current->user_time.tv_usec / 1e6,
+                   current->sys_time.tv_sec + current->sys_time.tv_usec / 1e6,
+                   current->max_rss, current->voluntary_switches, current->involuntary_switches);
         }
         else{
-            addProcess(&process_list, pCmd->next, pid2 ,RUNNING); // Terminated  
+            // Still running, or terminated without being reaped by the shell
+            printf("%.3f\t-\t-\t-\t-\t", current->status == TERMINATED ? 0.0 : (monotonicNs() - current->start_ns) / 1e9);
         }
+        printf("%s\n", current->command);
+        if(current->sample != NULL && current->end_ns != 0){
+            char text[256];
 
+            formatSample(current->sample, text, sizeof(text));
+            printf("\t\t%s\n", text);
+        }
     }
-    // fork failed 
-    else{
-        perror("fork failed for child 1\n");
-        exit(EXIT_FAILURE);
-    }
-}
 
-void execute(cmdLine *pCmdLine){
+    // Terminated processes are reported once
+    compactProcessTable(process_list, 0);
+}
 
-    pid_t pid;
-    int process_id, in_fd, out_fd;
-    char * command = pCmdLine->arguments[0]; 
+// procs -m: memory used by the process table
+void printProcessTableMemory(process_table* process_list){
+    size_t text_bytes = 0;
 
-    // Build in 'cd' command 
-    if (strcmp(command, "cd") == 0) {
-        // No directory was given
-        if (pCmdLine->arguments[1] == NULL) {
-            fprintf(stderr, "cd: missing argument\n");
-        } else if (chdir(pCmdLine->arguments[1]) != 0) { // Change current working directory - 0 is for success 
-            perror("cd failed");
-        }
-        freeCmdLines(pCmdLine);
-        return; // Command was executed
+    for(int pos = 0; pos < process_list->count; pos++){
+        text_bytes += strlen(process_list->procs[pos].command) + 1;
     }
+    printf("%d processes (%d terminated), %d records allocated, %d hash slots, %lu bytes\n",
+           process_list->count, process_list->terminated, process_list->capacity, process_list->index_size,
+           (unsigned long)(process_list->capacity * sizeof(process) + process_list->index_size * sizeof(int) + text_bytes));
+}
 
-    if (strcmp(command, "procs") == 0) {
-        printProcessList(&process_list);
-        freeCmdLines(pCmdLine);
-        return;
+//  Free all memory allocated for the process list.
+void freeProcessList(process_table* process_list){
+    for(int pos = 0; pos < process_list->count; pos++){
+        free(process_list->procs[pos].command);
+        freeSample(process_list->procs[pos].sample);
     }
+    free(process_list->procs);
+    free(process_list->index);
+    memset(process_list, 0, sizeof(process_table));
+}
 
-    // Process killing commands
-    else if(strcmp(command,"halt") == 0 || strcmp(command,"wakeup") == 0 || strcmp(command,"ice") == 0){
-        if(pCmdLine->arguments[1] == NULL){
-            fprintf(stderr, "%s: missing process-id\n",command);
-            freeCmdLines(pCmdLine);
-            return;
-        }
-
-        process_id = atoi(pCmdLine->arguments[1]);
-        if(process_id != 0){
-
-            if(strcmp(command,"halt") == 0){
-                haltProcess((pid_t)process_id);
-            }
+// Shell style exit code of a terminated child: its exit value, or 128 + the signal that killed it
+static int exitStatus(int wait_status){
+    return WIFEXITED(wait_status) ? WEXITSTATUS(wait_status) : 128 + WTERMSIG(wait_status);
+}
 
-            else if(strcmp(command,"wakeup") == 0){
-                wakeupProcess((pid_t)process_id);
-            }
+// Keep the resources a reaped child used, as reported by wait4, and report its counters if it was profiled
+static void recordUsage(process *reaped, const struct rusage *usage){
+    char text[256];
 
-            else{ 
-                iceProcess((pid_t)process_id);
-            }
-        }
-        else{
-            fprintf(stderr, "%s: process-id is not valid\n",command);
-        }
-        freeCmdLines(pCmdLine);
-        return;
+    reaped->end_ns = monotonicNs();
+    reaped->user_time = usage->ru_utime;
+    reaped->sys_time = usage->ru_stime;
+    reaped->max_rss = usage->ru_maxrss;
+    reaped->voluntary_switches = usage->ru_nvcsw;
+    reaped->involuntary_switches = usage->ru_nivcsw;
 
+    if(reaped->sample != NULL){
+        readCounters(reaped->sample);
+        formatSample(reaped->sample, text, sizeof(text));
+        fprintf(stderr, "profile [%d] %.*s: %s\n", reaped->pid, (int)strlen(reaped->command) - 1, reaped->command, text);
     }
+}
 
-    pid = fork(); // Create a child process 
+// Stages of the foreground job, with the exit status of each one taken down as it is reaped.
+// An in-shell procs stage drops the records of the stages it lists, so $? and $PIPESTATUS
+// cannot be read back from the process table.
+typedef struct foreground_job{
+    pid_t *pids;                          /* pid of each stage, -1 for one that is not a process */
+    int *statuses;                        /* exit status of each stage, -1 until it is reaped */
+    int count;                            /* number of stages, 0 while no foreground job is waited for */
+} foreground_job;
 
-    // Child process
-    if(pid == 0){
+foreground_job foreground = {NULL, NULL, 0};
 
-        if(pCmdLine->inputRedirect != NULL){
-            in_fd = open(pCmdLine-> inputRedirect,O_RDONLY);
-            if (in_fd < 0){ // Error in opening file
-                fprintf(stderr, "Could not input Redirect from %s\n", pCmdLine->inputRedirect);
-                freeCmdLines(pCmdLine);
-               _exit(1); 
-            }
-            dup2(in_fd,0); // Replace stdin with in_fd
-            close(in_fd);
+static void recordForegroundExit(pid_t pid, int exit_status){
+    for(int i = 0; i < foreground.count; i++){
+        if(foreground.pids[i] == pid){
+            foreground.statuses[i] = exit_status;
+            return;
         }
+    }
+}
 
-        if(pCmdLine->outputRedirect != NULL){
-            // 0 - for base octal, 6 - rw user, 4 - read group, 4 - read other
-            out_fd = open(pCmdLine->outputRedirect, O_WRONLY | O_CREAT | O_TRUNC, 0644); // O_WRONLY - write only, O_CREAT - create file if not exist, O_TRUNC - delete current input given file 
-            if (out_fd < 0){ // Error in opening file
-                fprintf(stderr, "Could not output Redirect from %s\n",pCmdLine->outputRedirect);
-                freeCmdLines(pCmdLine);
-               _exit(1); 
-            }
-            dup2(out_fd,1); // Replace stdout with out_fd
-            close(out_fd);
+// Exit status recorded for a stage of the foreground job, -1 if it was not reaped
+static int foregroundStatus(pid_t pid){
+    for(int i = 0; i < foreground.count; i++){
+        if(foreground.pids[i] == pid){
+            return foreground.statuses[i];
         }
+    }
+    return -1;
+}
 
-        if(execvp(command,pCmdLine->arguments)){ // Replace program with new process 
-            fprintf(stderr, "Operation failed\n");
-            freeCmdLines(pCmdLine);
-            _exit(1); // Exit immediately and safely - prevent duplicate or unintended output due to may sharr\ed buffers with parent 
-        }
+// Record the wait status and rusage of a foreground child the shell waited for directly
+void setProcessExitStatus(process_table* process_list, pid_t pid, int wait_status, const struct rusage *usage){
+    int pos = findProcess(process_list, pid);
+
+    last_status = exitStatus(wait_status);
+    recordForegroundExit(pid, last_status);
+    if(pos != -1){
+        setProcessStatus(process_list, pos, TERMINATED);
+        process_list->procs[pos].exit_status = last_status;
+        recordUsage(&process_list->procs[pos], usage);
     }
-    //Parent process 
-    else if (pid > 0){ 
-        if(debug_mode){
-            fprintf(stderr, "PID: %d\n", pid);
-            fprintf(stderr, "Executing command: %s\n", command);
+}
+
+// Collect every child that changed status since the last call.
+// One wait4 per event instead of one waitpid per tracked process.
+void updateProcessList(process_table* process_list){
+    struct rusage usage;
+    int status, pos;
+    pid_t pid;
+
+    // WNOHANG - Don't block (wait) if no child process has changed status. Just return immediately.
+    // -1 - any child; returns 0 once no more events are pending and -1 (ECHILD) when there are no children.
+    while((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage)) > 0){
+        pos = findProcess(process_list, pid);
+        if(pos == -1){
+            continue;
         }
-        
-        if(pCmdLine->blocking){
-            waitpid(pid,NULL,0); // Wait for child process to finish 
-            addProcess(&process_list, pCmdLine, pid,TERMINATED); // Terminated  
+        //  WIFEXITED &  WIFSIGNALED - returns true if the child terminated
+        if (WIFEXITED(status) || WIFSIGNALED(status)){
+            // Foreground commands are waited for directly, so this is a background process finishing
+            if(interactive && process_list->procs[pos].status != TERMINATED){
+                if(done_count == done_capacity){
+                    done_capacity = done_capacity ? 2 * done_capacity : 16;
+                    done_list = (done_notice*) realloc(done_list, done_capacity * sizeof(done_notice));
+                    if(done_list == NULL){
+                        perror("malloc failed");
+                        exit(1);
+                    }
+                }
+                // procs may drop the record before the notice is printed
+                done_list[done_count].pid = pid;
+                done_list[done_count].exit_status = exitStatus(status);
+                done_list[done_count++].command = strdup(process_list->procs[pos].command);
+            }
+            setProcessStatus(process_list, pos, TERMINATED);
+            process_list->procs[pos].exit_status = exitStatus(status);
+            recordForegroundExit(pid, exitStatus(status));
+            recordUsage(&process_list->procs[pos], &usage);
         }
-        else{
-            addProcess(&process_list, pCmdLine, pid, RUNNING);
+        // WIFSTOPPED - returns  true  if the child process was stopped by delivery of a signal;
+        else if (WIFSTOPPED(status)){
+            setProcessStatus(process_list, pos, SUSPENDED);
+        }
+        // WIFCONTINUED - return if a stopped child has been resumed by delivery of SIGCONT
+        else if (WIFCONTINUED(status)){
+            setProcessStatus(process_list, pos, RUNNING);
         }
     }
-    // Fork failed
-    else{
-        perror("fork failed");
-        exit(1);
+}
+
+static void sigchldHandler(int sig){
+    int saved_errno = errno;
+
+    // Async-signal-safe wake-up, a full pipe already means a pending wake-up
+    write(sigchld_pipe[1], "", 1);
+    errno = saved_errno;
+}
+
+void installSigchldHandler(){
+    struct sigaction action;
+
+    if(pipe2(sigchld_pipe, O_NONBLOCK | O_CLOEXEC) == -1){
+        perror("pipe failed");
+        exit(EXIT_FAILURE);
     }
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = sigchldHandler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART; // Keep getline and wait4 from failing with EINTR
+    sigaction(SIGCHLD, &action, NULL);
 }
 
-void addHistory(const char *terminal_cmd){
-    terminal_command *hist = (terminal_command *)malloc(sizeof(terminal_command));
-    // Memory allocation failed
-    if (hist == NULL) {
-        perror("malloc failed");
-        exit(1);
+// Empty the self-pipe, returns whether SIGCHLD fired since the last call
+static int drainSigchldPipe(){
+    char buffer[64];
+    int woken = 0;
+
+    while(read(sigchld_pipe[0], buffer, sizeof(buffer)) > 0){
+        woken = 1;
     }
+    return woken;
+}
 
-    hist->input_command = strdup(terminal_cmd);// Duplicate to keep command in history list;
-    hist->next = NULL;
-    if(history_size == 0){
-        history_head = hist;
-        history_size = 1;
+// Collect child status changes if SIGCHLD fired since the last call
+void reapChildren(){
+    if(drainSigchldPipe()){
+        updateProcessList(&process_list);
+        dispatchQueuedJobs();
     }
-    else {
-        if(history_size == HISTLEN){
-            terminal_command *to_delete = history_head;
-            history_head = history_head -> next;
-            free(to_delete->input_command);
-            free(to_delete);
+}
+
+// bash style notice for every background process that finished since the last prompt
+void printDoneNotices(){
+    for(int i = 0; i < done_count; i++){
+        if(done_list[i].exit_status == 0){
+            fprintf(stderr, "[%d] Done\t%s\n", done_list[i].pid, done_list[i].command);
         }
         else{
-            history_size++;
+            fprintf(stderr, "[%d] Exit %d\t%s\n", done_list[i].pid, done_list[i].exit_status, done_list[i].command);
         }
-        history_tail->next = hist;
+        free(done_list[i].command);
     }
-    history_tail = hist;
+    done_count = 0;
 }
 
-void printHistory(){
-    terminal_command *current = history_head;
-    int count = 1;
-    while(current != NULL){
-        printf("%d: %s",count,current->input_command);
-        count++;
-        current = current->next;
+// Find the process with the given id in the process_list and change its status to the received status.
+void updateProcessStatus(process_table* process_list, int pid, int status){
+    int pos = findProcess(process_list, pid);
+
+    if(pos != -1){
+        setProcessStatus(process_list, pos, status);
     }
 }
 
-const char *print_n_Command(int n){
-    terminal_command *current = history_head;
-
-    if( n > history_size + 1 || n < 1){
-        printf("history number %d does not exist", n);
-        return 0;
-    }
-    else{
-        while(n > 1){
-            current = current -> next;
-            n--;
+// Give every record of the job the same status
+static void setJobStatus(pid_t pgid, int status){
+    for(int pos = 0; pos < process_list.count; pos++){
+        if(process_list.procs[pos].pgid == pgid && process_list.procs[pos].status != TERMINATED){
+            setProcessStatus(&process_list, pos, status);
         }
-        return current->input_command;
     }
 }
 
-void free_historyList(){
-    terminal_command *current = history_head;
-    terminal_command *next = NULL;
+// Signal the whole job process_id belongs to with one killpg, so all stages of a pipeline stop or
+// resume together. Processes that stayed in the shell's own group are signalled alone.
+static void signalJob(pid_t process_id, int sig, const char *name, int status){
+    int pos = findProcess(&process_list, process_id);
+    pid_t pgid = pos != -1 ? process_list.procs[pos].pgid : 0;
 
-    while(current != NULL){
-        next = current->next;
-        current->next = NULL;
-        free(current->input_command); // Free memory allocation of strdup
-        free(current);
-        current = next;
+    if((pgid > 0 ? killpg(pgid, sig) : kill(process_id, sig)) == -1){
+        fprintf(stderr, "%d %s failed\n", process_id, name);
+    }
+    else if(pgid > 0){
+        fprintf(stderr, "Send signal %s to process group %d\n", name, pgid);
+        setJobStatus(pgid, status);
+    }
+    else {
+        fprintf(stderr, "Send signal %s to process %d\n", name, process_id);
+        updateProcessStatus(&process_list, process_id, status);
     }
 }
 
-void quit(){
-    freeProcessList(process_list);
-    free_historyList();
+void wakeupProcess(pid_t process_id){
+    signalJob(process_id, SIGCONT, "wakeup", RUNNING);
 }
 
+void haltProcess(pid_t process_id){
+    signalJob(process_id, SIGSTOP, "halt", SUSPENDED);
+}
 
-int main(int argc, char**argv) {
-    char cwd[PATH_MAX];  // Current working directory buffer
-    char input[2048];    // User input buffer
-    cmdLine *cmd = NULL;
+void iceProcess(pid_t process_id){
+    signalJob(process_id, SIGINT, "ice", TERMINATED);
+}
 
-    // Turn ON debug mode
-    for(int i=0; i< argc; i++){
-        if(strcmp(argv[i], "-d") == 0){
-            debug_mode = 1; 
-            break; // Stop after finding the -d flag
-        }
-    }
+static unsigned int nameHash(const char *name){
+    unsigned int hash = 5381;
 
-    while (1) {
+    while(*name){
+        hash = hash * 33 + (unsigned char)*name++;
+    }
+    return hash % PATH_CACHE_BUCKETS;
+}
 
-        if (getcwd(cwd, sizeof(cwd)) == NULL) { // Get current working directory
-            perror("getcwd");
-            exit(EXIT_FAILURE);
-        }
+void clearPathCache(){
+    path_entry *current, *next;
 
-        printf("%s> ", cwd); // Display prompt of current working directory
- 
-        // Read user input
-        if (fgets(input, sizeof(input), stdin) == NULL) { 
-            printf("\n");
-            break;  // Exit on Ctrl+D
+    for(int i = 0; i < PATH_CACHE_BUCKETS; i++){
+        for(current = path_cache[i]; current != NULL; current = next){
+            next = current->next;
+            free(current->name);
+            free(current->path);
+            free(current);
         }
+        path_cache[i] = NULL;
+    }
+    free(path_cache_env);
+    path_cache_env = NULL;
+}
 
-        if(strncmp(input,"!!",2) == 0){
-            if (history_size != 0){
-                printf("%s",history_tail->input_command);
-                strcpy(input, history_tail->input_command);  // Copy the command
-            }
-            else{
-                perror("No history is available");
-            }
-        }
+// Drop a stale entry, e.g. after the binary it points at disappeared
+void forgetCommand(const char *name){
+    path_entry **link = &path_cache[nameHash(name)];
+    path_entry *current;
 
-        else if (input[0] == '!' && input[1] != '\0') {
-            const char* cmd = print_n_Command(atoi(input + 1));
-            if (cmd != NULL) {
-                strcpy(input, cmd); // Copy command into input
-            }
+    while((current = *link) != NULL){
+        if(strcmp(current->name, name) == 0){
+            *link = current->next;
+            free(current->name);
+            free(current->path);
+            free(current);
+            return;
         }
-        addHistory(input);
+        link = &current->next;
+    }
+}
 
-        input[strcspn(input, "\n")] = '\0';
+// Search the directories of env_path for an executable name, leaving its full path in candidate
+// (PATH_MAX bytes). Returns the position of its directory in env_path, -1 if it is not found.
+static int searchPath(const char *name, const char *env_path, char *candidate){
+    const char *dir, *end;
+    struct stat info;
+    int dir_index = 0;
 
-        if(strncmp(input,"hist",4) == 0){
-            printHistory();
-            continue;
+    for(dir = env_path; ; dir = end + 1, dir_index++){
+        end = strchr(dir, ':');
+        if(end == NULL){
+            end = dir + strlen(dir);
         }
+        // An empty $PATH entry means the current directory
+        snprintf(candidate, PATH_MAX, "%.*s%s%s", (int)(end - dir), dir, end == dir ? "." : "", "/");
+        strncat(candidate, name, PATH_MAX - strlen(candidate) - 1);
 
-        // User entered quit, exit program 
-        if(strncmp(input,"quit",4) == 0){
-            quit();
-            return 0;
+        path_lookup_syscalls++;
+        if(stat(candidate, &info) == 0 && S_ISREG(info.st_mode) && (info.st_mode & 0111)){
+            return dir_index;
+        }
+        if(*end == '\0'){
+            return -1;
         }
+    }
+}
 
-        cmd = parseCmdLines(input);
+// Return the full path of a command name, searching $PATH only on the first launch.
+// Returns NULL for names containing a '/' (used as given) and for commands that are not found.
+const char *resolveCommand(const char *name){
+    const char *env_path = getenv("PATH");
+    char candidate[PATH_MAX];
+    path_entry *entry;
+    int dir_index;
 
-        if(cmd != NULL){
-            if(cmd->next != NULL){
-                executePipeCommand(cmd);
-            }
-            else{
-                execute(cmd);
-            }
-        }
+    if(strchr(name, '/') != NULL){
+        return NULL;
+    }
+    if(env_path == NULL){
+        env_path = "/bin:/usr/bin"; // Same default search path as execvp
+    }
+    // A different $PATH can resolve every name differently
+    if(path_cache_env == NULL || strcmp(path_cache_env, env_path) != 0){
+        clearPathCache();
+        path_cache_env = strdup(env_path);
     }
 
+    for(entry = path_cache[nameHash(name)]; entry != NULL; entry = entry->next){
+        if(strcmp(entry->name, name) == 0){
+            entry->hits++;
+            path_execvp_syscalls += entry->dir_index + 1;
+            return entry->path;
+        }
+    }
+
+    dir_index = searchPath(name, env_path, candidate);
+    if(dir_index == -1){
+        return NULL;
+    }
+    entry = (path_entry*) malloc(sizeof(path_entry));
+    if(entry == NULL){
+        perror("malloc failed");
+        exit(1);
+    }
+    entry->name = strdup(name);
+    entry->path = strdup(candidate);
+    entry->hits = 1;
+    entry->dir_index = dir_index;
+    entry->next = path_cache[nameHash(name)];
+    path_cache[nameHash(name)] = entry;
+    path_execvp_syscalls += dir_index + 1;
+    return entry->path;
+}
+
+// hash: list cached commands with their hit counts, hash -r: forget them all, hash name...: look names up now
+void hashCommand(cmdLine *pCmdLine){
+    path_entry *current;
+    int empty = 1;
+
+    if(pCmdLine->argCount == 1){
+        for(int i = 0; i < PATH_CACHE_BUCKETS; i++){
+            for(current = path_cache[i]; current != NULL; current = current->next){
+                if(empty){
+                    printf("hits\tcommand\n");
+                    empty = 0;
+                }
+                printf("%4d\t%s\n", current->hits, current->path);
+            }
+        }
+        if(empty){
+            printf("hash: hash table empty\n");
+        }
+        return;
+    }
+
+    for(int i = 1; i < pCmdLine->argCount; i++){
+        if(strcmp(pCmdLine->arguments[i], "-r") == 0){
+            clearPathCache();
+        }
+        else if(resolveCommand(pCmdLine->arguments[i]) == NULL){
+            fprintf(stderr, "hash: %s: not found\n", pCmdLine->arguments[i]);
+        }
+        else{
+            // Looking a name up is not a launch
+            for(current = path_cache[nameHash(pCmdLine->arguments[i])]; current != NULL; current = current->next){
+                if(strcmp(current->name, pCmdLine->arguments[i]) == 0){
+                    current->hits--;
+                    path_execvp_syscalls -= current->dir_index + 1;
+                }
+            }
+        }
+    }
+}
+
+static size_t varNameLength(const char *assignment){
+    return strcspn(assignment, "=");
+}
+
+static int isVarName(const char *name, size_t length){
+    if(length == 0 || (!isalpha((unsigned char)name[0]) && name[0] != '_')){
+        return 0;
+    }
+    for(size_t i = 1; i < length; i++){
+        if(!isalnum((unsigned char)name[i]) && name[i] != '_'){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static unsigned int varHash(const char *name, size_t length){
+    unsigned int hash = 2166136261u; // FNV-1a
+
+    for(size_t i = 0; i < length; i++){
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// (Re)build the index of environ if it is stale
+static void indexEnvironment(void){
+    unsigned int slot;
+
+    if(shell_env.envp == environ && environ != NULL){
+        return;
+    }
+    for(shell_env.count = 0; environ != NULL && environ[shell_env.count] != NULL; shell_env.count++);
+    if(shell_env.size < 2 * shell_env.count + 2){
+        for(shell_env.size = 16; shell_env.size < 2 * shell_env.count + 2; shell_env.size *= 2);
+        free(shell_env.slots);
+        shell_env.slots = (int*) malloc(shell_env.size * sizeof(int));
+        if(shell_env.slots == NULL){
+            perror("malloc failed");
+            exit(1);
+        }
+    }
+    memset(shell_env.slots, -1, shell_env.size * sizeof(int));
+    for(int i = 0; i < shell_env.count; i++){
+        slot = varHash(environ[i], varNameLength(environ[i])) & (shell_env.size - 1);
+        while(shell_env.slots[slot] != -1){
+            slot = (slot + 1) & (shell_env.size - 1);
+        }
+        shell_env.slots[slot] = i;
+    }
+    shell_env.envp = environ;
+}
+
+// Position in environ of the variable named by the first length bytes of name, -1 if not set
+static int findVariable(const char *name, size_t length){
+    unsigned int slot;
+    const char *entry;
+
+    indexEnvironment();
+    for(slot = varHash(name, length) & (shell_env.size - 1); shell_env.slots[slot] != -1;
+        slot = (slot + 1) & (shell_env.size - 1)){
+        entry = environ[shell_env.slots[slot]];
+        if(strncmp(entry, name, length) == 0 && entry[length] == '='){
+            return shell_env.slots[slot];
+        }
+    }
+    return -1;
+}
+
+// envp of a command: environ itself, or with NAME=value assignments a copy of environ with them
+// merged in. The copy is only an array of pointers, the strings stay in environ and the command
+// line; the caller frees it once the command is launched.
+static char **jobEnvironment(cmdLine *pCmdLine){
+    const char *assignment;
+    char **envp;
+    int count, position;
+    size_t length;
+
+    if(pCmdLine->assignmentCount == 0){
+        return environ;
+    }
+    indexEnvironment();
+    envp = (char**) malloc((shell_env.count + pCmdLine->assignmentCount + 1) * sizeof(char*));
+    if(envp == NULL){
+        perror("malloc failed");
+        exit(1);
+    }
+    memcpy(envp, environ, shell_env.count * sizeof(char*));
+    count = shell_env.count;
+    for(int i = 0; i < pCmdLine->assignmentCount; i++){
+        assignment = pCmdLine->assignments[i];
+        length = varNameLength(assignment);
+        position = findVariable(assignment, length);
+        // A variable new to the environment may still be assigned twice on the same command
+        if(position == -1){
+            for(position = shell_env.count; position < count && strncmp(envp[position], assignment, length + 1) != 0; position++);
+            if(position == count){
+                count++;
+            }
+        }
+        envp[position] = (char*) assignment;
+    }
+    envp[count] = NULL;
+    return envp;
+}
+
+// The value of the last PATH= assignment of the command, NULL if it has none
+static const char *jobPath(cmdLine *pCmdLine){
+    for(int i = pCmdLine->assignmentCount - 1; i >= 0; i--){
+        if(strncmp(pCmdLine->assignments[i], "PATH=", 5) == 0){
+            return pCmdLine->assignments[i] + 5;
+        }
+    }
+    return NULL;
+}
+
+static int findShellVar(const char *name, size_t length){
+    for(int i = 0; i < shell_var_count; i++){
+        if(strncmp(shell_vars[i], name, length) == 0 && shell_vars[i][length] == '='){
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void removeShellVar(const char *name, size_t length){
+    int i = findShellVar(name, length);
+
+    if(i != -1){
+        free(shell_vars[i]);
+        shell_vars[i] = shell_vars[--shell_var_count];
+    }
+}
+
+// NAME=value on the shell: sets the variable in the environment when exporting or when it is
+// already there, and as a shell variable, for a later export, otherwise
+static void assignVariable(const char *assignment, int exported){
+    size_t length = varNameLength(assignment);
+    char *name = strndup(assignment, length);
+    int i;
+
+    if(exported || findVariable(assignment, length) != -1){
+        setenv(name, assignment + length + 1, 1);
+        shell_env.envp = NULL;
+        removeShellVar(assignment, length);
+    }
+    else if((i = findShellVar(assignment, length)) != -1){
+        free(shell_vars[i]);
+        shell_vars[i] = strdup(assignment);
+    }
+    else{
+        if(shell_var_count == shell_var_capacity){
+            shell_var_capacity = shell_var_capacity ? 2 * shell_var_capacity : 16;
+            shell_vars = (char**) realloc(shell_vars, shell_var_capacity * sizeof(char*));
+            if(shell_vars == NULL){
+                perror("malloc failed");
+                exit(1);
+            }
+        }
+        shell_vars[shell_var_count++] = strdup(assignment);
+    }
+    free(name);
+}
+
+// export: list the environment, export NAME=value or NAME: put the variable in it
+static void builtinExport(cmdLine *pCmdLine){
+    const char *arg;
+    size_t length;
+    int i;
+
+    if(pCmdLine->argCount == 1){
+        for(char **variable = environ; variable != NULL && *variable != NULL; variable++){
+            printf("export %s\n", *variable);
+        }
+        return;
+    }
+    for(int a = 1; a < pCmdLine->argCount; a++){
+        arg = pCmdLine->arguments[a];
+        length = varNameLength(arg);
+        if(!isVarName(arg, length)){
+            fprintf(stderr, "export: %s: not a valid identifier\n", arg);
+            last_status = 1;
+        }
+        else if(arg[length] == '='){
+            assignVariable(arg, 1);
+        }
+        // A name only: export the shell variable, if it has been assigned
+        else if((i = findShellVar(arg, length)) != -1){
+            assignVariable(shell_vars[i], 1);
+        }
+    }
+}
+
+// unset NAME...: remove variables from the environment and the shell
+static void builtinUnset(cmdLine *pCmdLine){
+    for(int a = 1; a < pCmdLine->argCount; a++){
+        unsetenv(pCmdLine->arguments[a]);
+        shell_env.envp = NULL;
+        removeShellVar(pCmdLine->arguments[a], strlen(pCmdLine->arguments[a]));
+    }
+}
+
+// A here-doc streamed into a pipe by a thread of the shell
+typedef struct here_writer{
+    int fd;                               /* write end of the pipe */
+    char *data;                           /* copy of the payload, the command line is freed before it is written */
+    size_t length;
+} here_writer;
+
+static void *hereWriter(void *arg){
+    here_writer *writer = (here_writer*)arg;
+    size_t written = 0;
+    ssize_t done;
+
+    // Started with every signal blocked: a reader that quits gives EPIPE instead of killing the shell
+    while(written < writer->length){
+        done = write(writer->fd, writer->data + written, writer->length - written);
+        if(done == -1 && errno == EINTR){
+            continue;
+        }
+        if(done <= 0){
+            break;
+        }
+        written += done;
+    }
+    close(writer->fd);
+    free(writer->data);
+    free(writer);
+    return NULL;
+}
+
+// stdin for a '<<<' or '<<' payload. Up to HERE_MEMFD_MAX it is written to a memfd, sealed so
+// that it cannot change under the command, and read from offset 0. A larger payload is fed to a
+// pipe by a detached thread, so it is never held twice in full. Returns -1 on failure.
+static int hereInput(const char *data){
+    size_t length = strlen(data), written = 0;
+    ssize_t done;
+    int fd, pipe_fd[2];
+    here_writer *writer;
+    pthread_t thread;
+    sigset_t all, saved;
+
+    if(length <= HERE_MEMFD_MAX && (fd = memfd_create("here-doc", MFD_CLOEXEC | MFD_ALLOW_SEALING)) != -1){
+        while(written < length && (done = write(fd, data + written, length - written)) > 0){
+            written += done;
+        }
+        if(written == length && fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == 0 &&
+           lseek(fd, 0, SEEK_SET) == 0){
+            return fd;
+        }
+        close(fd);
+    }
+
+    if(pipe2(pipe_fd, O_CLOEXEC) == -1){
+        perror("pipe failed");
+        return -1;
+    }
+    writer = (here_writer*) malloc(sizeof(here_writer));
+    if(writer == NULL || (writer->data = (char*) malloc(length)) == NULL){
+        perror("malloc failed");
+        exit(1);
+    }
+    memcpy(writer->data, data, length);
+    writer->length = length;
+    writer->fd = pipe_fd[1];
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &saved);
+    if(pthread_create(&thread, NULL, hereWriter, writer) != 0){
+        perror("pthread_create failed");
+        close(pipe_fd[0]);
+        close(pipe_fd[1]);
+        free(writer->data);
+        free(writer);
+        pipe_fd[0] = -1;
+    }
+    else{
+        pthread_detach(thread);
+    }
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    return pipe_fd[0];
+}
+
+// Launch pCmdLine with in_fd/out_fd as stdin/stdout (-1 keeps the shell's, or the redirection file
+// or here-doc if given). Returns the pid of the child, or -1 if it could not be launched.
+// pgid is the process group the child goes to: 0 for a new group it leads, -1 to stay in the shell's
+pid_t spawnCommand(cmdLine *pCmdLine, int in_fd, int out_fd, pid_t pgid){
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attributes;
+    sigset_t job_signals;
+    struct timespec start, end;
+    const char *path, *job_path;
+    char **envp, job_candidate[PATH_MAX];
+    pid_t pid = -1;
+    int err, go_pipe[2] = {-1, -1}, here_fd = -1, redirect_in = -1, redirect_out = -1;
+    char go;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    launch_status = 127;
+    if(in_fd == -1 && pCmdLine->hereData != NULL && (here_fd = in_fd = hereInput(pCmdLine->hereData)) == -1){
+        launch_status = 1;
+        return -1;
+    }
+
+    // NAME=value assignments only go into the command's own envp, the shell's environ is left as is.
+    // A PATH= among them is searched without the cache, which belongs to the shell's $PATH.
+    envp = jobEnvironment(pCmdLine);
+    job_path = jobPath(pCmdLine);
+    if(job_path != NULL){
+        path = strchr(pCmdLine->arguments[0], '/') == NULL && searchPath(pCmdLine->arguments[0], job_path, job_candidate) != -1
+               ? job_candidate : NULL;
+    }
+    else{
+        path = resolveCommand(pCmdLine->arguments[0]);
+    }
+
+    // Profiled launches need the fork path: the child waits for its counters before calling exec
+    if(launch_profile && pipe2(go_pipe, O_CLOEXEC) == -1){
+        perror("pipe failed");
+        go_pipe[0] = go_pipe[1] = -1;
+    }
+
+    if(fork_backend || go_pipe[0] != -1){
+        // The child cannot drop a stale cache entry, so make sure the cached binary is still there
+        if(path != NULL && job_path == NULL){
+            path_lookup_syscalls++;
+            if(access(path, X_OK) == -1 && errno == ENOENT){
+                forgetCommand(pCmdLine->arguments[0]);
+                path = resolveCommand(pCmdLine->arguments[0]);
+            }
+        }
+
+        pid = fork(); // Create a child process
+
+        // Child process
+        if(pid == 0){
+            if(go_pipe[0] != -1){
+                close(go_pipe[1]);
+                // EOF once the parent has attached the counters
+                while(read(go_pipe[0], &go, 1) == -1 && errno == EINTR);
+                close(go_pipe[0]);
+            }
+
+            if(pgid != -1){
+                setpgid(0, pgid);
+            }
+            // The shell ignores the job control signals, its jobs must not
+            signal(SIGTSTP, SIG_DFL);
+            signal(SIGTTIN, SIG_DFL);
+            signal(SIGTTOU, SIG_DFL);
+
+            if(in_fd != -1){
+                dup2(in_fd, 0); // Replace stdin with in_fd
+                close(in_fd);
+            }
+            else if(pCmdLine->inputRedirect != NULL){
+                in_fd = open(pCmdLine->inputRedirect, O_RDONLY);
+                if (in_fd < 0){ // Error in opening file
+                    fprintf(stderr, "Could not input Redirect from %s\n", pCmdLine->inputRedirect);
+                    _exit(1);
+                }
+                dup2(in_fd,0); // Replace stdin with in_fd
+                close(in_fd);
+            }
+
+            if(out_fd != -1){
+                dup2(out_fd, 1); // Replace stdout with out_fd
+                close(out_fd);
+            }
+            else if(pCmdLine->outputRedirect != NULL){
+                // 0 - for base octal, 6 - rw user, 4 - read group, 4 - read other
+                out_fd = open(pCmdLine->outputRedirect, O_WRONLY | O_CREAT | O_TRUNC, 0644); // O_WRONLY - write only, O_CREAT - create file if not exist, O_TRUNC - delete current input given file
+                if (out_fd < 0){ // Error in opening file
+                    fprintf(stderr, "Could not output Redirect from %s\n",pCmdLine->outputRedirect);
+                    _exit(1);
+                }
+                dup2(out_fd,1); // Replace stdout with out_fd
+                close(out_fd);
+            }
+
+            if(launch_nice != 0 && setpriority(PRIO_PROCESS, 0, launch_nice) == -1){
+                perror("setpriority failed");
+            }
+
+            environ = envp; // The command's environment, execvp included
+            if(path != NULL){
+                execv(path, pCmdLine->arguments); // Replace program with new process
+            }
+            // Not cached, or the cached binary is gone: let execvp search $PATH
+            execvp(pCmdLine->arguments[0], pCmdLine->arguments);
+            fprintf(stderr, "Operation failed\n");
+            // 127, the status the posix_spawn backend gives a command it could not run
+            _exit(127); // Exit immediately and safely - prevent duplicate or unintended output due to may sharr\ed buffers with parent
+        }
+        // Fork failed
+        else if(pid < 0){
+            perror("fork failed");
+        }
+        // Also set from the parent, so the group exists before the next stage joins it
+        else if(pgid != -1){
+            setpgid(pid, pgid ? pgid : pid);
+        }
+
+        if(go_pipe[0] != -1){
+            close(go_pipe[0]);
+            if(pid > 0){
+                pending_sample = openCounters(pid);
+            }
+            close(go_pipe[1]); // Let the child exec
+        }
+    }
+    else{
+        // posix_spawn runs the redirections and pipe wiring as file actions inside a vfork-style
+        // child, so launch cost does not grow with the size of the shell's address space.
+        posix_spawn_file_actions_init(&actions);
+        posix_spawnattr_init(&attributes);
+        sigemptyset(&job_signals);
+        sigaddset(&job_signals, SIGTSTP);
+        sigaddset(&job_signals, SIGTTIN);
+        sigaddset(&job_signals, SIGTTOU);
+        posix_spawnattr_setsigdefault(&attributes, &job_signals);
+        if(pgid != -1){
+            posix_spawnattr_setpgroup(&attributes, pgid);
+        }
+        posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGDEF | (pgid != -1 ? POSIX_SPAWN_SETPGROUP : 0));
+
+        // The redirections are opened here rather than as file actions, whose failures posix_spawn
+        // would report just like a failed exec. Same order and messages as the fork child.
+        err = 0;
+        if(in_fd == -1 && pCmdLine->inputRedirect != NULL
+           && (in_fd = redirect_in = open(pCmdLine->inputRedirect, O_RDONLY | O_CLOEXEC)) == -1){
+            fprintf(stderr, "Could not input Redirect from %s\n", pCmdLine->inputRedirect);
+            err = -1;
+        }
+        else if(out_fd == -1 && pCmdLine->outputRedirect != NULL
+                && (out_fd = redirect_out = open(pCmdLine->outputRedirect, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1){
+            fprintf(stderr, "Could not output Redirect from %s\n", pCmdLine->outputRedirect);
+            err = -1;
+        }
+        if(in_fd != -1){
+            posix_spawn_file_actions_adddup2(&actions, in_fd, 0);
+        }
+        if(out_fd != -1){
+            posix_spawn_file_actions_adddup2(&actions, out_fd, 1);
+        }
+
+        if(err == -1){
+            launch_status = 1;
+        }
+        else if(path != NULL){
+            err = posix_spawn(&pid, path, &actions, &attributes, pCmdLine->arguments, envp);
+            if(err == ENOENT && job_path == NULL){
+                // The cached binary is gone, search $PATH again
+                forgetCommand(pCmdLine->arguments[0]);
+                path = resolveCommand(pCmdLine->arguments[0]);
+                if(path != NULL){
+                    err = posix_spawn(&pid, path, &actions, &attributes, pCmdLine->arguments, envp);
+                }
+            }
+        }
+        else if(strchr(pCmdLine->arguments[0], '/') != NULL){
+            err = posix_spawn(&pid, pCmdLine->arguments[0], &actions, &attributes, pCmdLine->arguments, envp);
+        }
+        else{
+            err = ENOENT; // Not found in any $PATH directory
+        }
+        posix_spawn_file_actions_destroy(&actions);
+        posix_spawnattr_destroy(&attributes);
+        if(redirect_in != -1){
+            close(redirect_in);
+        }
+        if(redirect_out != -1){
+            close(redirect_out);
+        }
+        if(err != 0){
+            if(err != -1){
+                fprintf(stderr, "Operation failed: %s: %s\n", pCmdLine->arguments[0], strerror(err));
+            }
+            pid = -1;
+        }
+        // posix_spawn has no attribute for the nice value, set it as soon as the child exists
+        else if(launch_nice != 0 && setpriority(PRIO_PROCESS, pid, launch_nice) == -1){
+            perror("setpriority failed");
+        }
+    }
+
+    if(here_fd != -1){
+        close(here_fd);
+    }
+    if(envp != environ){
+        free(envp);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    spawn_count++;
+    spawn_total_ns += (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec);
+
+    return pid;
+}
+
+// wait [-n] [pid...]: block until the given background processes (all of them by default) terminate,
+// or with -n until the first of them does. Each process is watched through a pidfd, so pids that get
+// reused while waiting cannot be confused, and a single epoll_wait multiplexes all of them.
+void waitProcesses(cmdLine *pCmdLine){
+    struct epoll_event event, events[64];
+    struct pollfd wakeup = {sigchld_pipe[0], POLLIN, 0};
+    pid_t *targets;
+    int *pidfds;         // pidfd of every target still being waited for, -1 once it terminated
+    int target_count = 0, any = 0, remaining = 0, epoll_fd = -1, ready, pos, i;
+
+    targets = (pid_t*) malloc((pCmdLine->argCount + process_list.count) * sizeof(pid_t));
+    pidfds = (int*) malloc((pCmdLine->argCount + process_list.count) * sizeof(int));
+    if(targets == NULL || pidfds == NULL){
+        perror("malloc failed");
+        exit(1);
+    }
+
+    for(i = 1; i < pCmdLine->argCount; i++){
+        if(strcmp(pCmdLine->arguments[i], "-n") == 0){
+            any = 1;
+        }
+        else if((pos = findProcess(&process_list, atoi(pCmdLine->arguments[i]))) != -1){
+            targets[target_count++] = process_list.procs[pos].pid;
+        }
+        else{
+            fprintf(stderr, "wait: pid %s is not a child of this shell\n", pCmdLine->arguments[i]);
+            last_status = 127;
+        }
+    }
+    // No pids given: every process still tracked as running or suspended
+    if(pCmdLine->argCount == 1 + any){
+        for(pos = 0; pos < process_list.count; pos++){
+            if(process_list.procs[pos].status != TERMINATED){
+                targets[target_count++] = process_list.procs[pos].pid;
+            }
+        }
+    }
+
+    // All of them first: wait -n stops the loop below at a target that already terminated
+    for(i = 0; i < target_count; i++){
+        pidfds[i] = -1;
+    }
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    for(i = 0; i < target_count; i++){
+        pos = findProcess(&process_list, targets[i]);
+        if(process_list.procs[pos].status == TERMINATED){
+            last_status = process_list.procs[pos].exit_status; // Reaped already
+            if(any){
+                remaining = 0;
+                break;
+            }
+            continue;
+        }
+#ifdef SYS_pidfd_open
+        if(epoll_fd != -1){
+            pidfds[i] = syscall(SYS_pidfd_open, targets[i], 0);
+        }
+#endif
+        if(pidfds[i] == -1 && epoll_fd != -1){
+            // Kernel without pidfds, fall back to sleeping on the SIGCHLD self-pipe
+            for(int j = 0; j < i; j++){
+                if(pidfds[j] != -1){
+                    close(pidfds[j]);
+                    pidfds[j] = -1;
+                }
+            }
+            close(epoll_fd);
+            epoll_fd = -1;
+        }
+        if(pidfds[i] != -1){
+            event.events = EPOLLIN;
+            event.data.u32 = i;
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pidfds[i], &event);
+        }
+        remaining++;
+    }
+
+    while(remaining > 0){
+        if(epoll_fd != -1){
+            // A pidfd turns readable once its process terminated
+            ready = epoll_wait(epoll_fd, events, 64, -1);
+            if(ready == -1){
+                continue; // EINTR from SIGCHLD
+            }
+            updateProcessList(&process_list);
+            for(int j = 0; j < ready; j++){
+                i = events[j].data.u32;
+                close(pidfds[i]); // Also drops it from the epoll set
+                pidfds[i] = -1;
+                remaining--;
+                if((pos = findProcess(&process_list, targets[i])) != -1){
+                    last_status = process_list.procs[pos].exit_status;
+                }
+            }
+            dispatchQueuedJobs(); // Into the slots just freed, as reapChildren does
+        }
+        else{
+            poll(&wakeup, 1, -1);
+            reapChildren();
+            for(i = 0; i < target_count; i++){
+                pos = findProcess(&process_list, targets[i]);
+                if(pos != -1 && process_list.procs[pos].status == TERMINATED && pidfds[i] != -2){
+                    pidfds[i] = -2; // Counted as done
+                    remaining--;
+                    last_status = process_list.procs[pos].exit_status;
+                }
+            }
+        }
+        if(any){
+            break;
+        }
+    }
+
+    // wait -n leaves the other pidfds open
+    for(i = 0; i < target_count; i++){
+        if(pidfds[i] >= 0){
+            close(pidfds[i]);
+        }
+    }
+    if(epoll_fd != -1){
+        close(epoll_fd);
+    }
+    free(targets);
+    free(pidfds);
+}
+
+static int jobBefore(const queued_job *a, const queued_job *b){
+    return a->priority < b->priority || (a->priority == b->priority && a->seq < b->seq);
+}
+
+// A pipe buffer size: a byte count with an optional K, M or G suffix, capped at
+// /proc/sys/fs/pipe-max-size, the most an unprivileged process may ask for. -1 if it is not valid.
+static long pipeSizeArg(const char *text){
+    static long max_size = 0;
+    char *end;
+    unsigned long long size; // 64 bits even where long is not, so that 4G does not wrap
+    int shift = 0;
+    FILE *limit;
+
+    errno = 0;
+    size = strtoull(text, &end, 10);
+    switch(*end){
+        case 'K': case 'k': shift = 10; end++; break;
+        case 'M': case 'm': shift = 20; end++; break;
+        case 'G': case 'g': shift = 30; end++; break;
+    }
+    if(!isdigit((unsigned char) text[0]) || *end != '\0' || errno == ERANGE || size > ULLONG_MAX >> shift){
+        fprintf(stderr, "pipesz: invalid size %s\n", text);
+        return -1;
+    }
+
+    if(max_size == 0){
+        limit = fopen("/proc/sys/fs/pipe-max-size", "r");
+        if(limit == NULL || fscanf(limit, "%ld", &max_size) != 1){
+            max_size = 1 << 20;
+        }
+        if(limit != NULL){
+            fclose(limit);
+        }
+    }
+    size <<= shift;
+    if(size > (unsigned long long) max_size){
+        fprintf(stderr, "pipesz: %s is over fs.pipe-max-size, using %ld\n", text, max_size);
+        size = max_size;
+    }
+    return (long) size;
+}
+
+// Give a pipe the buffer size of the job being launched. The kernel rounds it up to a power of
+// two pages; a failure (over the per-user pipe page limit) keeps the default.
+static void sizePipe(int fd){
+    if(launch_pipe_size > 0 && fcntl(fd, F_SETPIPE_SZ, launch_pipe_size) == -1 && debug_mode){
+        perror("F_SETPIPE_SZ failed");
+    }
+}
+
+// Hold a background job until 'set maxjobs' admits it. The queue takes ownership of pCmd.
+void queueJob(cmdLine *pCmd, int priority, int profile, long pipe_size){
+    queued_job job, swap;
+    cmdLine *stage;
+    size_t length = 0;
+    int pos, parent;
+
+    if(queued_jobs.count == queued_jobs.capacity){
+        queued_jobs.capacity = queued_jobs.capacity ? 2 * queued_jobs.capacity : 16;
+        queued_jobs.jobs = (queued_job*) realloc(queued_jobs.jobs, queued_jobs.capacity * sizeof(queued_job));
+        if(queued_jobs.jobs == NULL){
+            perror("malloc failed");
+            exit(1);
+        }
+    }
+
+    for(stage = pCmd; stage != NULL; stage = stage->next){
+        for(int i = 0; i < stage->argCount; i++){
+            length += strlen(stage->arguments[i]) + 1;
+        }
+        length += 2;
+    }
+    job.command = (char*) malloc(length + 1);
+    if(job.command == NULL){
+        perror("malloc failed");
+        exit(1);
+    }
+    job.command[0] = '\0';
+    for(stage = pCmd, length = 0; stage != NULL; stage = stage->next){
+        for(int i = 0; i < stage->argCount; i++){
+            length += sprintf(job.command + length, "%s ", stage->arguments[i]);
+        }
+        if(stage->next != NULL){
+            length += sprintf(job.command + length, "| ");
+        }
+    }
+    job.cmd = pCmd;
+    job.priority = priority;
+    job.profile = profile;
+    job.pipe_size = pipe_size;
+    job.seq = queued_jobs.next_seq++;
+
+    // Sift up
+    pos = queued_jobs.count++;
+    queued_jobs.jobs[pos] = job;
+    while(pos > 0 && jobBefore(&queued_jobs.jobs[pos], &queued_jobs.jobs[parent = (pos - 1) / 2])){
+        swap = queued_jobs.jobs[parent];
+        queued_jobs.jobs[parent] = queued_jobs.jobs[pos];
+        queued_jobs.jobs[pos] = swap;
+        pos = parent;
+    }
+
+    if(debug_mode){
+        fprintf(stderr, "Queued job: %s\n", job.command);
+    }
+}
+
+static queued_job popQueuedJob(){
+    queued_job top = queued_jobs.jobs[0], swap;
+    int pos = 0, child;
+
+    // Sift down
+    queued_jobs.jobs[0] = queued_jobs.jobs[--queued_jobs.count];
+    while((child = 2 * pos + 1) < queued_jobs.count){
+        if(child + 1 < queued_jobs.count && jobBefore(&queued_jobs.jobs[child + 1], &queued_jobs.jobs[child])){
+            child++;
+        }
+        if(!jobBefore(&queued_jobs.jobs[child], &queued_jobs.jobs[pos])){
+            break;
+        }
+        swap = queued_jobs.jobs[child];
+        queued_jobs.jobs[child] = queued_jobs.jobs[pos];
+        queued_jobs.jobs[pos] = swap;
+        pos = child;
+    }
+    return top;
+}
+
+// Launch a parsed line at the given nice value, profiled or not, with pipes of buffer size pipesz
+// (0 for the 'set pipesz' one). Takes ownership of pCmd.
+static void launchJob(cmdLine *pCmd, int priority, int profile, long pipesz){
+    launch_nice = priority;
+    launch_profile = profile;
+    launch_pipe_size = pipesz > 0 ? pipesz : pipe_size;
+    if(pCmd->next != NULL){
+        executePipeCommand(pCmd);
+    }
+    else{
+        execute(pCmd);
+    }
+    launch_nice = 0;
+    launch_profile = 0;
+    launch_pipe_size = 0;
+}
+
+// Admit queued jobs, best priority first, while fewer than max_jobs processes are running
+void dispatchQueuedJobs(){
+    int saved_status = last_status; // Background launches do not change $?
+    queued_job job;
+
+    while(queued_jobs.count > 0 && (max_jobs == 0 || process_list.running < max_jobs)){
+        job = popQueuedJob();
+        free(job.command);
+        launchJob(job.cmd, job.priority, job.profile, job.pipe_size);
+    }
+    last_status = saved_status;
+}
+
+void freeJobQueue(){
+    for(int i = 0; i < queued_jobs.count; i++){
+        freeCmdLines(queued_jobs.jobs[i].cmd);
+        free(queued_jobs.jobs[i].command);
+    }
+    free(queued_jobs.jobs);
+    memset(&queued_jobs, 0, sizeof(job_queue));
+}
+
+// Launch every job still queued, waiting for running ones to free their slots, so that the jobs
+// 'set maxjobs' held back are not dropped when the shell exits
+void drainJobQueue(){
+    static char *wait_args[] = {"wait", "-n", NULL};
+    cmdLine wait_cmd = {.arguments = wait_args, .argCount = 2};
+    int saved_status = last_status; // The exit status of the shell
+
+    if(interactive && queued_jobs.count > 0){
+        fprintf(stderr, "Starting %d queued jobs before exiting\n", queued_jobs.count);
+    }
+    dispatchQueuedJobs();
+    while(queued_jobs.count > 0){
+        waitProcesses(&wait_cmd);
+        dispatchQueuedJobs();
+    }
+    last_status = saved_status;
+}
+
+// A running job of the parallel builtin
+typedef struct parallel_job{
+    pid_t pid;                            /* 0 while the slot is free */
+    int output_fd;                        /* memfd holding the job's stdout, -1 if not grouped */
+    const char *item;                     /* the item the job was started for */
+} parallel_job;
+
+// Copy of word with every {} replaced by item
+static char *substituteItem(const char *word, const char *item){
+    size_t item_length = strlen(item), length = strlen(word);
+    const char *s, *mark;
+    char *result, *out;
+
+    for(s = word; (s = strstr(s, "{}")) != NULL; s += 2){
+        length += item_length - 2;
+    }
+    result = out = (char*) malloc(length + 1);
+    if(result == NULL){
+        perror("malloc failed");
+        exit(1);
+    }
+    for(s = word; (mark = strstr(s, "{}")) != NULL; s = mark + 2){
+        memcpy(out, s, mark - s);
+        out += mark - s;
+        memcpy(out, item, item_length);
+        out += item_length;
+    }
+    strcpy(out, s);
+    return result;
+}
+
+// Items for parallel, one per line of the given stream
+static char **readItems(FILE *stream, int *count){
+    char **items = NULL, *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t length;
+    int capacity = 0;
+
+    *count = 0;
+    while((length = getline(&line, &line_capacity, stream)) != -1){
+        if(length > 0 && line[length - 1] == '\n'){
+            line[length - 1] = '\0';
+        }
+        if(*count == capacity){
+            capacity = capacity ? 2 * capacity : 64;
+            items = (char**) realloc(items, capacity * sizeof(char*));
+            if(items == NULL){
+                perror("malloc failed");
+                exit(1);
+            }
+        }
+        items[(*count)++] = strdup(line);
+    }
+    free(line);
+    return items;
+}
+
+// Write everything a finished job printed to stdout in one piece
+static void flushJobOutput(int output_fd){
+    char buffer[65536];
+    ssize_t length;
+
+    fflush(stdout);
+    lseek(output_fd, 0, SEEK_SET);
+    while((length = read(output_fd, buffer, sizeof(buffer))) > 0){
+        if(write(1, buffer, length) != length){
+            break;
+        }
+    }
+    close(output_fd);
+}
+
+// parallel [-j N] [-a file] command [args] [::: items...]: run the command once per item with every {}
+// in its arguments replaced by the item, or the item appended when there is no {}. Items follow :::,
+// or are read one per line from the -a file or from stdin. At most N jobs (one per CPU by default)
+// run at once and the next one is launched as soon as one finishes. Every job writes its stdout into
+// a memfd that is copied out when the job ends, so outputs of concurrent jobs never interleave.
+// Under job control the jobs run in a process group of their own that gets the terminal, as a
+// foreground job does, so ^C stops the batch and not the shell.
+void parallelCommand(cmdLine *pCmdLine){
+    struct pollfd wakeup = {sigchld_pipe[0], POLLIN, 0};
+    struct timespec start, end;
+    struct rusage usage;
+    parallel_job *slots;
+    cmdLine job;
+    char **items, **job_args;
+    const char *item_file = NULL;
+    FILE *stream;
+    int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int first = 1, separator, template_count, item_count, own_items = 0;
+    int next = 0, running = 0, failed = 0, has_placeholder = 0, status, s, i;
+    pid_t pgid = -1;
+
+    for(; first < pCmdLine->argCount; first++){
+        if(strncmp(pCmdLine->arguments[first], "-j", 2) == 0 && pCmdLine->arguments[first][2] != '\0'){
+            jobs = atoi(pCmdLine->arguments[first] + 2);
+        }
+        else if(strcmp(pCmdLine->arguments[first], "-j") == 0 && first + 1 < pCmdLine->argCount){
+            jobs = atoi(pCmdLine->arguments[++first]);
+        }
+        else if(strcmp(pCmdLine->arguments[first], "-a") == 0 && first + 1 < pCmdLine->argCount){
+            item_file = pCmdLine->arguments[++first];
+        }
+        else{
+            break;
+        }
+    }
+    for(separator = first; separator < pCmdLine->argCount && strcmp(pCmdLine->arguments[separator], ":::") != 0; separator++);
+    template_count = separator - first;
+    if(template_count == 0 || jobs <= 0){
+        fprintf(stderr, "usage: parallel [-j N] [-a file] command [args with {}] [::: items...]\n");
+        last_status = 2;
+        return;
+    }
+    for(i = first; i < separator; i++){
+        has_placeholder |= strstr(pCmdLine->arguments[i], "{}") != NULL;
+    }
+
+    if(separator < pCmdLine->argCount){
+        items = (char**) pCmdLine->arguments + separator + 1;
+        item_count = pCmdLine->argCount - separator - 1;
+    }
+    else{
+        stream = item_file != NULL ? fopen(item_file, "r") : stdin;
+        if(stream == NULL){
+            perror(item_file);
+            last_status = 1;
+            return;
+        }
+        items = readItems(stream, &item_count);
+        if(stream != stdin){
+            fclose(stream);
+        }
+        own_items = 1;
+    }
+
+    slots = (parallel_job*) calloc(jobs, sizeof(parallel_job));
+    job_args = (char**) malloc((template_count + 2) * sizeof(char*));
+    if(slots == NULL || job_args == NULL){
+        perror("malloc failed");
+        exit(1);
+    }
+    memset(&job, 0, sizeof(job));
+    job.arguments = job_args;
+    job.blocking = 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while(next < item_count || running > 0){
+        // Fill every free slot
+        for(s = 0; s < jobs && next < item_count; s++){
+            while(slots[s].pid == 0 && next < item_count){
+                slots[s].item = items[next++];
+                job.argCount = 0;
+                for(i = first; i < separator; i++){
+                    job_args[job.argCount++] = substituteItem(pCmdLine->arguments[i], slots[s].item);
+                }
+                if(!has_placeholder){
+                    job_args[job.argCount++] = strdup(slots[s].item);
+                }
+                job_args[job.argCount] = NULL;
+
+                slots[s].output_fd = memfd_create("parallel", MFD_CLOEXEC);
+                // The group lives as long as one of its jobs is unreaped; once they all are,
+                // the next job leads a new one
+                if(job_control && running == 0){
+                    pgid = 0;
+                }
+                slots[s].pid = spawnCommand(&job, -1, slots[s].output_fd, pgid);
+                if(slots[s].pid > 0 && pgid == 0){
+                    pgid = slots[s].pid;
+                    tcsetpgrp(0, pgid);
+                }
+                if(slots[s].pid > 0){
+                    addProcess(&process_list, &job, slots[s].pid, 0, RUNNING);
+                    running++;
+                }
+                else{
+                    slots[s].pid = 0;
+                    if(slots[s].output_fd != -1){
+                        close(slots[s].output_fd);
+                    }
+                    fprintf(stderr, "parallel: %s: could not be started\n", slots[s].item);
+                    failed++;
+                }
+                for(i = 0; i < job.argCount; i++){
+                    free(job_args[i]);
+                }
+            }
+        }
+        if(running == 0){
+            continue;
+        }
+
+        // Sleep on the SIGCHLD self-pipe, then look only at our own jobs. Other background
+        // children are left for updateProcessList below, so they still get their Done notices.
+        poll(&wakeup, 1, -1);
+        drainSigchldPipe();
+        for(s = 0; s < jobs; s++){
+            if(slots[s].pid == 0 || wait4(slots[s].pid, &status, WNOHANG, &usage) != slots[s].pid){
+                continue;
+            }
+            if(slots[s].output_fd != -1){
+                flushJobOutput(slots[s].output_fd);
+            }
+            setProcessExitStatus(&process_list, slots[s].pid, status, &usage);
+            // ^C: no new jobs, the running ones got it as well
+            if(WIFSIGNALED(status) && WTERMSIG(status) == SIGINT){
+                next = item_count;
+            }
+            if(last_status != 0){
+                fprintf(stderr, "parallel: %s: exit %d\n", slots[s].item, last_status);
+                failed++;
+            }
+            slots[s].pid = 0;
+            running--;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if(pgid != -1){
+        tcsetpgrp(0, shell_pgid);
+    }
+    updateProcessList(&process_list);
+
+    fprintf(stderr, "parallel: %d jobs, %d failed, %.3f s wall time\n", item_count, failed,
+            (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    // As GNU parallel: the number of failed jobs, 101 for more than 100
+    last_status = failed > 100 ? 101 : failed;
+
+    if(own_items){
+        for(i = 0; i < item_count; i++){
+            free(items[i]);
+        }
+        free(items);
+    }
+    free(job_args);
+    free(slots);
+}
+
+// Wait for a foreground job: count processes of process group pgid (0 for the shell's own group),
+// with last_pid the last stage, which decides $?. While it runs the job owns the terminal, so ^C and
+// ^Z reach every stage and not the shell. Returns early, leaving the job suspended, if it is stopped.
+static void waitForJob(pid_t pgid, int count, pid_t last_pid){
+    struct rusage usage;
+    int status, pos;
+    pid_t pid;
+
+    if(job_control && pgid > 0){
+        tcsetpgrp(0, pgid);
+    }
+    while(count > 0){
+        pid = wait4(-pgid, &status, WUNTRACED, &usage);
+        if(pid == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            break;
+        }
+        if(WIFSTOPPED(status)){
+            // The other stages got the same signal, their stop events are collected later
+            updateProcessStatus(&process_list, pid, SUSPENDED);
+            if(pgid > 0){
+                setJobStatus(pgid, SUSPENDED);
+            }
+            fprintf(stderr, "\n[%d] Stopped\n", pgid > 0 ? pgid : pid);
+            break;
+        }
+        setProcessExitStatus(&process_list, pid, status, &usage);
+        count--;
+    }
+    if(job_control && pgid > 0){
+        tcsetpgrp(0, shell_pgid);
+    }
+
+    if(count > 0){
+        last_status = 128 + SIGTSTP;
+    }
+    else if(last_pid == -1){
+        last_status = launch_status; // The last stage could not be launched
+    }
+    else if((status = foregroundStatus(last_pid)) != -1){
+        last_status = status;
+    }
+    else if((pos = findProcess(&process_list, last_pid)) != -1){
+        last_status = process_list.procs[pos].exit_status;
+    }
+}
+
+// jobs: every job with a stage still running or suspended, with the status of each stage.
+// The stages of a job are consecutive records of the table.
+void printJobs(){
+    int pos, end, running, suspended;
+
+    updateProcessList(&process_list);
+    for(pos = 0; pos < process_list.count; pos = end){
+        running = suspended = 0;
+        for(end = pos; end < process_list.count && process_list.procs[end].pgid == process_list.procs[pos].pgid &&
+            (end == pos || process_list.procs[pos].pgid != 0); end++){
+            running += process_list.procs[end].status == RUNNING;
+            suspended += process_list.procs[end].status == SUSPENDED;
+        }
+        if(running + suspended == 0){
+            continue;
+        }
+        printf("[%d]\t%s\t", process_list.procs[pos].pgid ? process_list.procs[pos].pgid : process_list.procs[pos].pid,
+               statusName(running ? RUNNING : SUSPENDED));
+        for(int stage = pos; stage < end; stage++){
+            process *current = &process_list.procs[stage];
+            printf("%s%.*s (%s", stage == pos ? "" : " | ", (int)strlen(current->command) - 1, current->command, statusName(current->status));
+            if(current->status == TERMINATED && current->exit_status != -1){
+                printf(" %d", current->exit_status);
+            }
+            printf(")");
+        }
+        printf("\n");
+    }
+}
+
+// fg [pid] / bg [pid]: continue the job of pid, by default the newest one not terminated, in the
+// foreground with the terminal, or in the background
+void continueJob(cmdLine *pCmdLine, int foreground){
+    int pos, count = 0;
+    pid_t pgid, last_pid = -1;
+
+    if(pCmdLine->argCount > 1){
+        pos = findProcess(&process_list, atoi(pCmdLine->arguments[1]));
+    }
+    else{
+        updateProcessList(&process_list);
+        for(pos = process_list.count - 1; pos >= 0 && process_list.procs[pos].status == TERMINATED; pos--);
+    }
+    if(pos == -1 || process_list.procs[pos].status == TERMINATED){
+        fprintf(stderr, "%s: no such job\n", pCmdLine->arguments[0]);
+        last_status = 1;
+        return;
+    }
+    pgid = process_list.procs[pos].pgid;
+    if(pgid == 0){
+        fprintf(stderr, "%s: %d is not in a job of its own\n", pCmdLine->arguments[0], process_list.procs[pos].pid);
+        last_status = 1;
+        return;
+    }
+
+    for(pos = 0; pos < process_list.count; pos++){
+        if(process_list.procs[pos].pgid == pgid){
+            fprintf(stderr, "%s%.*s", last_pid == -1 ? "" : " | ", (int)strlen(process_list.procs[pos].command) - 1, process_list.procs[pos].command);
+            last_pid = process_list.procs[pos].pid;
+            count += process_list.procs[pos].status != TERMINATED;
+        }
+    }
+    fprintf(stderr, foreground ? "\n" : " &\n");
+
+    if(killpg(pgid, SIGCONT) == -1){
+        perror("killpg failed");
+        last_status = 1;
+        return;
+    }
+    setJobStatus(pgid, RUNNING);
+    last_status = 0;
+    if(foreground){
+        waitForJob(pgid, count, last_pid);
+    }
+}
+
+// Build in 'cd' command
+static void builtinCd(cmdLine *pCmdLine){
+    // No directory was given
+    if (pCmdLine->arguments[1] == NULL) {
+        fprintf(stderr, "cd: missing argument\n");
+        last_status = 1;
+    } else if (chdir(pCmdLine->arguments[1]) != 0) { // Change current working directory - 0 is for success
+        perror("cd failed");
+        last_status = 1;
+    }
+}
+
+static void builtinProcs(cmdLine *pCmdLine){
+    if(pCmdLine->arguments[1] != NULL && strcmp(pCmdLine->arguments[1], "-m") == 0){
+        printProcessTableMemory(&process_list);
+    }
+    else{
+        printProcessList(&process_list);
+    }
+}
+
+// set -e / set +e: stop at the first failing command, or keep going
+static void builtinSet(cmdLine *pCmdLine){
+    long size;
+
+    for(int i = 1; i < pCmdLine->argCount; i++){
+        if(strcmp(pCmdLine->arguments[i], "-e") == 0 || strcmp(pCmdLine->arguments[i], "+e") == 0){
+            errexit = pCmdLine->arguments[i][0] == '-';
+        }
+        // set maxjobs=N: queue '&' jobs while N processes are running, 0 lifts the limit
+        else if(strncmp(pCmdLine->arguments[i], "maxjobs=", 8) == 0){
+            max_jobs = atoi(pCmdLine->arguments[i] + 8);
+            if(max_jobs < 0){
+                max_jobs = 0;
+            }
+            dispatchQueuedJobs();
+        }
+        // set pipesz=SIZE: buffer size of the pipes of later pipelines, 0 for the kernel default
+        else if(strncmp(pCmdLine->arguments[i], "pipesz=", 7) == 0){
+            size = pipeSizeArg(pCmdLine->arguments[i] + 7);
+            if(size >= 0){
+                pipe_size = size;
+            }
+            else{
+                last_status = 1;
+            }
+        }
+        // set globsort=0|1: whether glob matches are sorted
+        else if(strncmp(pCmdLine->arguments[i], "globsort=", 9) == 0){
+            glob_sort = atoi(pCmdLine->arguments[i] + 9) != 0;
+        }
+        else{
+            fprintf(stderr, "set: unknown option %s\n", pCmdLine->arguments[i]);
+            last_status = 1;
+        }
+    }
+}
+
+static void builtinWait(cmdLine *pCmdLine){
+    waitProcesses(pCmdLine);
+    // Waiting for everything includes the jobs still queued
+    while(pCmdLine->argCount == 1 && queued_jobs.count > 0){
+        dispatchQueuedJobs();
+        waitProcesses(pCmdLine);
+    }
+}
+
+static void builtinJobs(cmdLine *pCmdLine){
+    printJobs();
+}
+
+static void builtinFg(cmdLine *pCmdLine){
+    continueJob(pCmdLine, 1);
+}
+
+static void builtinBg(cmdLine *pCmdLine){
+    continueJob(pCmdLine, 0);
+}
+
+// hist, hist grep <pattern>, hist -n <prefix>. A pattern of several words is matched with single spaces between them.
+static void builtinHist(cmdLine *pCmdLine){
+    char *pattern;
+    size_t length = 0;
+    int prefix;
+
+    if(pCmdLine->argCount < 3 || (strcmp(pCmdLine->arguments[1], "grep") != 0 && strcmp(pCmdLine->arguments[1], "-n") != 0)){
+        printHistory();
+        return;
+    }
+    prefix = pCmdLine->arguments[1][0] == '-';
+    for(int i = 2; i < pCmdLine->argCount; i++){
+        length += strlen(pCmdLine->arguments[i]) + 1;
+    }
+    pattern = (char*) malloc(length);
+    if(pattern == NULL){
+        perror("malloc failed");
+        exit(1);
+    }
+    pattern[0] = '\0';
+    for(int i = 2, offset = 0; i < pCmdLine->argCount; i++){
+        offset += sprintf(pattern + offset, i > 2 ? " %s" : "%s", pCmdLine->arguments[i]);
+    }
+    searchHistory(pattern, prefix);
+    free(pattern);
+}
+
+// Process killing commands
+static void builtinSignal(cmdLine *pCmdLine){
+    const char *command = pCmdLine->arguments[0];
+    int process_id;
+
+    if(pCmdLine->arguments[1] == NULL){
+        fprintf(stderr, "%s: missing process-id\n",command);
+        last_status = 1;
+        return;
+    }
+
+    process_id = atoi(pCmdLine->arguments[1]);
+    if(process_id == 0){
+        fprintf(stderr, "%s: process-id is not valid\n",command);
+        last_status = 1;
+    }
+    else if(strcmp(command,"halt") == 0){
+        haltProcess((pid_t)process_id);
+    }
+    else if(strcmp(command,"wakeup") == 0){
+        wakeupProcess((pid_t)process_id);
+    }
+    else{
+        iceProcess((pid_t)process_id);
+    }
+}
+
+// Builtins that only report and write to stdout. In a foreground pipeline they run inside the
+// shell, writing straight into the pipe; the others get a forked child there, as in a subshell.
+#define BUILTIN_OUTPUT 1
+
+typedef struct builtin{
+    const char *name;
+    void (*run)(cmdLine *pCmdLine);
+    int flags;
+} builtin;
+
+// Sorted by name for bsearch
+static const builtin builtins[] = {
+    {"bg", builtinBg, 0},
+    {"cd", builtinCd, 0},
+    {"export", builtinExport, 0},
+    {"fg", builtinFg, 0},
+    {"halt", builtinSignal, 0},
+    {"hash", hashCommand, BUILTIN_OUTPUT},
+    {"hist", builtinHist, BUILTIN_OUTPUT},
+    {"ice", builtinSignal, 0},
+    {"jobs", builtinJobs, BUILTIN_OUTPUT},
+    {"parallel", parallelCommand, 0},
+    {"procs", builtinProcs, BUILTIN_OUTPUT},
+    {"set", builtinSet, 0},
+    {"unset", builtinUnset, 0},
+    {"wait", builtinWait, 0},
+    {"wakeup", builtinSignal, 0},
+};
+
+static int compareBuiltin(const void *name, const void *entry){
+    return strcmp((const char*)name, ((const builtin*)entry)->name);
+}
+
+static const builtin *findBuiltin(const char *name){
+    return bsearch(name, builtins, sizeof(builtins) / sizeof(builtins[0]), sizeof(builtin), compareBuiltin);
+}
+
+// Run a builtin in the shell with its stdout on out_fd (-1 for the shell's own stdout, or the
+// command's '>' file). Leaves the builtin's status in last_status.
+static void runBuiltin(const builtin *command, cmdLine *pCmdLine, int out_fd){
+    int saved_stdout = -1, file_fd = -1;
+    void (*saved_sigpipe)(int);
+
+    if(out_fd == -1 && pCmdLine->outputRedirect != NULL){
+        file_fd = out_fd = open(pCmdLine->outputRedirect, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(file_fd == -1){
+            fprintf(stderr, "Could not output Redirect from %s\n", pCmdLine->outputRedirect);
+            last_status = 1;
+            return;
+        }
+    }
+    if(out_fd != -1){
+        fflush(stdout);
+        saved_stdout = fcntl(1, F_DUPFD_CLOEXEC, 10);
+        dup2(out_fd, 1);
+    }
+    // A reader that quits early must not take the shell down with SIGPIPE
+    saved_sigpipe = signal(SIGPIPE, SIG_IGN);
+
+    last_status = 0;
+    command->run(pCmdLine);
+
+    fflush(stdout);
+    clearerr(stdout);
+    signal(SIGPIPE, saved_sigpipe);
+    if(saved_stdout != -1){
+        dup2(saved_stdout, 1);
+        close(saved_stdout);
+    }
+    if(file_fd != -1){
+        close(file_fd);
+    }
+}
+
+// A forked child that runs shell code instead of exec'ing: it joins the job's process group,
+// takes the default job control signals and drops every close-on-exec descriptor as an exec would,
+// so it holds no pipe end of another stage. What it keeps must be dup2'd or cleared first.
+static void enterForkedChild(pid_t pgid){
+    DIR *fds;
+    struct dirent *entry;
+    int fd;
+
+    if(pgid != -1){
+        setpgid(0, pgid);
+    }
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+
+    fds = opendir("/proc/self/fd");
+    if(fds != NULL){
+        while((entry = readdir(fds)) != NULL){
+            fd = atoi(entry->d_name);
+            if(fd > 2 && fd != dirfd(fds) && (fcntl(fd, F_GETFD) & FD_CLOEXEC)){
+                close(fd);
+            }
+        }
+        closedir(fds);
+    }
+}
+
+// A builtin as a pipeline stage that has to run alongside the others: a forked child of the
+// shell runs it, so it cannot change the shell's own state
+static pid_t forkBuiltin(const builtin *command, cmdLine *pCmdLine, int in_fd, int out_fd, pid_t pgid){
+    pid_t pid;
+
+    fflush(stdout);
+    pid = fork();
+    if(pid == 0){
+        if(in_fd == -1 && pCmdLine->inputRedirect != NULL){
+            in_fd = open(pCmdLine->inputRedirect, O_RDONLY);
+            if(in_fd == -1){
+                fprintf(stderr, "Could not input Redirect from %s\n", pCmdLine->inputRedirect);
+                _exit(1);
+            }
+        }
+        if(in_fd != -1){
+            dup2(in_fd, 0);
+        }
+        if(out_fd != -1){
+            dup2(out_fd, 1);
+        }
+        enterForkedChild(pgid);
+        // Opened only now, so that the writer of a large here-doc keeps its pipe
+        if(in_fd == -1 && pCmdLine->hereData != NULL && (in_fd = hereInput(pCmdLine->hereData)) != -1){
+            dup2(in_fd, 0);
+            close(in_fd);
+        }
+        // Its own SIGCHLD pipe, the one of the shell is gone with the other close-on-exec descriptors
+        installSigchldHandler();
+        runBuiltin(command, pCmdLine, -1);
+        _exit(last_status);
+    }
+    else if(pid < 0){
+        perror("fork failed");
+        launch_status = 127;
+    }
+    else if(pgid != -1){
+        setpgid(pid, pgid ? pgid : pid);
+    }
+    return pid;
+}
+
+// Record the status of stage of the pipeline that ran last
+static void setPipeStatus(int stage, int status){
+    if(stage >= pipe_status_capacity){
+        pipe_status_capacity = pipe_status_capacity ? 2 * pipe_status_capacity : 16;
+        while(stage >= pipe_status_capacity){
+            pipe_status_capacity *= 2;
+        }
+        pipe_status = (int*) realloc(pipe_status, pipe_status_capacity * sizeof(int));
+        if(pipe_status == NULL){
+            perror("malloc failed");
+            exit(1);
+        }
+    }
+    pipe_status[stage] = status;
+    pipe_status_count = stage + 1;
+}
+
+// Splice len bytes from one pipe into another. Returns what is left when the reader is gone, 0 once all is moved.
+static ssize_t splicePipe(int from, int to, ssize_t len){
+    ssize_t moved;
+
+    while(len > 0){
+        moved = splice(from, NULL, to, NULL, len, SPLICE_F_MOVE);
+        if(moved == -1 && errno == EINTR){
+            continue;
+        }
+        if(moved <= 0){
+            break;
+        }
+        len -= moved;
+    }
+    return len;
+}
+
+// Copy everything read from in_fd to each of out_fds without it passing through user space.
+// tee(2) duplicates the pages in the input pipe without consuming them and splice(2) moves them
+// on. A tee cannot be resumed halfway, so each copy is teed whole into an empty pipe as large as
+// the input and spliced on from there; the last copy is spliced from the input itself, which
+// consumes the data. A consumer that exits is dropped and the others go on; the producer gets
+// SIGPIPE once none is left. A slow consumer holds back the others, as with tee(1).
+static void fanoutCopy(int in_fd, int *out_fds, int count){
+    int copy_pipe[2], sink, open_count = count, last, k, copied;
+    ssize_t len, left;
+
+    signal(SIGPIPE, SIG_IGN);
+    sink = open("/dev/null", O_WRONLY);
+    if(pipe(copy_pipe) == -1){
+        perror("pipe failed");
+        _exit(1);
+    }
+    fcntl(copy_pipe[1], F_SETPIPE_SZ, fcntl(in_fd, F_GETPIPE_SZ));
+
+    while(open_count > 0){
+        for(last = count - 1; out_fds[last] == -1; last--);
+
+        // Wait for the producer; 0 is the end of its output
+        len = tee(in_fd, copy_pipe[1], 1 << 30, 0);
+        if(len == -1 && errno == EINTR){
+            continue;
+        }
+        if(len <= 0){
+            break;
+        }
+        copied = 1;
+        for(k = 0; k < last; k++){
+            if(out_fds[k] == -1){
+                continue;
+            }
+            while(!copied && tee(in_fd, copy_pipe[1], len, 0) == -1 && errno == EINTR);
+            copied = 0;
+            left = splicePipe(copy_pipe[0], out_fds[k], len);
+            if(left > 0){
+                splicePipe(copy_pipe[0], sink, left);
+                close(out_fds[k]);
+                out_fds[k] = -1;
+                open_count--;
+            }
+        }
+        if(copied){
+            splicePipe(copy_pipe[0], sink, len); // Every consumer but the last is gone
+        }
+        left = splicePipe(in_fd, out_fds[last], len);
+        if(left > 0){
+            splicePipe(in_fd, sink, left);
+            close(out_fds[last]);
+            out_fds[last] = -1;
+            open_count--;
+        }
+    }
+}
+
+// Launch the process that copies the output of a fan-out producer (the read end in_fd) to each
+// of count consumers. Their read ends are returned in consumer_fds, the shell keeps no write end.
+static pid_t startFanout(int in_fd, int *consumer_fds, int count, pid_t pgid){
+    int *out_fds = (int*) malloc(count * sizeof(int));
+    int pipe_fd[2], k;
+    pid_t pid;
+
+    if(out_fds == NULL){
+        perror("malloc failed");
+        exit(1);
+    }
+    for(k = 0; k < count; k++){
+        if(pipe2(pipe_fd, O_CLOEXEC) == -1){
+            perror("pipe failed");
+            exit(EXIT_FAILURE);
+        }
+        sizePipe(pipe_fd[1]);
+        consumer_fds[k] = pipe_fd[0];
+        out_fds[k] = pipe_fd[1];
+    }
+
+    pid = fork();
+    if(pid == 0){
+        fcntl(in_fd, F_SETFD, 0);
+        for(k = 0; k < count; k++){
+            fcntl(out_fds[k], F_SETFD, 0);
+        }
+        enterForkedChild(pgid);
+        fanoutCopy(in_fd, out_fds, count);
+        _exit(0);
+    }
+    else if(pid < 0){
+        perror("fork failed");
+    }
+    else if(pgid != -1){
+        setpgid(pid, pgid ? pgid : pid);
+    }
+
+    for(k = 0; k < count; k++){
+        close(out_fds[k]);
+    }
+    free(out_fds);
+    return pid;
+}
+
+void executePipeCommand(cmdLine *pCmd){
+    int pipe_fd[2];   // pipe_fd[0] - read end, pipe_fd[1] - write end;
+    int prev_read = -1; // Read end of the pipe feeding the current stage, -1 for the first stage
+    int stage_count = 0, launched = 0, running, pos, i;
+    char blocking = 0;
+    pid_t pgid, pid;  // Process group of the whole pipeline: 0 until the first stage is launched
+    cmdLine *current, *in_shell_cmd = NULL;
+    const builtin *shell_builtin, *in_shell = NULL; // The stage the shell runs itself, once the others are up
+    int in_shell_out = -1, in_shell_status = 0, in_shell_stage = 0;
+    int consumer_count = 0, consumer = 0, *consumer_fds = NULL; // Read ends of the fan-out consumers
+    pid_t *pids;
+    int *statuses;    // Exit status of each stage, kept up to date while it is the foreground job
+    static char *fanout_args[] = {"|&", NULL};
+    cmdLine fanout_cmd = {.arguments = fanout_args, .argCount = 1}; // The copying process, as procs lists it
+
+    for(current = pCmd; current != NULL; current = current->next){
+        consumer_count += current->fanout;
+        // Only the first stage may read from a file and only the last one may write to a file,
+        // or with a fan-out, the last stage of each consumer
+        if((current != pCmd && (current->inputRedirect != NULL || current->hereData != NULL)) ||
+           (current->next != NULL && current->outputRedirect != NULL && !(consumer_count > 0 && current->next->fanout))){
+            fprintf(stderr, "Error: cannot redirect left-side output or right-side input in a pipe\n");
+            freeCmdLines(pCmd);
+            return;
+        }
+        stage_count++;
+        blocking = current->blocking; // Only the last stage carries the '&' indicator
+    }
+
+    if(consumer_count > 0){
+        consumer_fds = (int*) malloc(consumer_count * sizeof(int));
+    }
+    pids = (pid_t*) malloc((stage_count + 1) * sizeof(pid_t)); // And the fan-out copier
+    statuses = (int*) malloc(stage_count * sizeof(int));
+    if(pids == NULL || statuses == NULL){
+        perror("malloc failed");
+        exit(1);
+    }
+    pids[stage_count] = -1;
+    if(blocking){
+        foreground.pids = pids;
+        foreground.statuses = statuses;
+        foreground.count = stage_count;
+    }
+
+    // Without job control, foreground pipelines stay in the shell's group, as in a non-interactive bash
+    pgid = blocking && !job_control ? -1 : 0;
+
+    for(i = 0, current = pCmd; current != NULL; i++, current = current->next){
+        pipe_fd[0] = pipe_fd[1] = -1;
+        if(current->fanout){
+            prev_read = consumer_fds[consumer++];
+        }
+
+        // Every stage but the last writes into a fresh pipe, except the last stage of a fan-out
+        // consumer. O_CLOEXEC makes sure no stage keeps a stray copy of a pipe end it does not use,
+        // which would hold off EOF downstream.
+        if(current->next != NULL && (!current->next->fanout || consumer == 0)){
+            if(pipe2(pipe_fd, O_CLOEXEC) == -1){
+                perror("pipe failed");
+                freeCmdLines(pCmd);
+                exit(EXIT_FAILURE);
+            }
+            sizePipe(pipe_fd[1]);
+        }
+
+        shell_builtin = findBuiltin(current->arguments[0]);
+        if(shell_builtin != NULL && (shell_builtin->flags & BUILTIN_OUTPUT) && blocking && in_shell == NULL){
+            // Runs in the shell after the other stages are launched, keeping the write end of its pipe
+            in_shell = shell_builtin;
+            in_shell_cmd = current;
+            in_shell_stage = i;
+            in_shell_out = pipe_fd[1];
+            pipe_fd[1] = -1;
+            pids[i] = -1;
+            statuses[i] = last_status = 0;
+        }
+        else{
+            if(shell_builtin != NULL){
+                pids[i] = forkBuiltin(shell_builtin, current, prev_read, pipe_fd[1], pgid);
+            }
+            else{
+                pids[i] = spawnCommand(current, prev_read, pipe_fd[1], pgid);
+            }
+            last_status = pids[i] == -1 ? launch_status : 0; // The last stage decides
+            statuses[i] = pids[i] == -1 ? launch_status : -1;
+        }
+
+        // Each stage gets its own entry. Stages that could not be launched are not tracked.
+        if(pids[i] != -1){
+            if(pgid == 0){
+                pgid = pids[i];
+            }
+            addProcess(&process_list, current, pids[i], pgid == -1 ? 0 : pgid, RUNNING);
+            launched++;
+        }
+
+        if(debug_mode && pids[i] != -1){
+            fprintf(stderr, "PID: %d\n", pids[i]);
+            fprintf(stderr, "Executing command: %s\n", current->arguments[0]);
+        }
+
+        // Parent keeps only the read end that feeds the next stage
+        if(prev_read != -1){
+            close(prev_read);
+        }
+        if(pipe_fd[1] != -1){
+            close(pipe_fd[1]);
+        }
+        prev_read = pipe_fd[0];
+
+        // End of the fan-out producer: the copying process feeds a pipe for each consumer
+        if(current->next != NULL && current->next->fanout && consumer == 0){
+            pid = pids[stage_count] = startFanout(prev_read, consumer_fds, consumer_count, pgid);
+            close(prev_read);
+            if(pid != -1){
+                if(pgid == 0){
+                    pgid = pid;
+                }
+                addProcess(&process_list, &fanout_cmd, pid, pgid == -1 ? 0 : pgid, RUNNING);
+                launched++;
+            }
+        }
+    }
+
+    running = launched;
+    if(in_shell != NULL){
+        // The job owns the terminal while the builtin feeds it, a pager downstream may read from it
+        if(job_control && pgid > 0){
+            tcsetpgrp(0, pgid);
+        }
+        runBuiltin(in_shell, in_shell_cmd, in_shell_out);
+        in_shell_status = last_status;
+        statuses[in_shell_stage] = in_shell_status;
+        if(in_shell_out != -1){
+            close(in_shell_out); // EOF for the next stage
+        }
+        // procs and jobs update the table, reaping the stages that are already done
+        for(i = 0, running = 0; i <= stage_count; i++){
+            running += pids[i] != -1 && (pos = findProcess(&process_list, pids[i])) != -1 &&
+                       process_list.procs[pos].status != TERMINATED;
+        }
+    }
+
+    if(blocking && launched > 0){
+        waitForJob(pgid == -1 ? 0 : pgid, running, pids[stage_count - 1]); // Wait for every stage to finish
+    }
+    else if(job_control && pgid > 0 && in_shell != NULL){
+        tcsetpgrp(0, shell_pgid);
+    }
+    if(in_shell != NULL && in_shell_cmd->next == NULL){
+        last_status = in_shell_status;
+    }
+
+    foreground.count = 0;
+
+    // $PIPESTATUS. Only a stopped job leaves stages that were not reaped, they count as the job does.
+    for(i = 0; blocking && i < stage_count; i++){
+        setPipeStatus(i, statuses[i] != -1 ? statuses[i] : 128 + SIGTSTP);
+    }
+
+    freeCmdLines(pCmd);
+    free(pids);
+    free(statuses);
+    free(consumer_fds);
+}
+
+void execute(cmdLine *pCmdLine){
+
+    pid_t pid;
+    int status = -1;
+    char * command = pCmdLine->arguments[0]; 
+    const builtin *shell_builtin = findBuiltin(command);
+
+    last_status = 0;
+
+    if(shell_builtin != NULL){
+        runBuiltin(shell_builtin, pCmdLine, -1);
+        freeCmdLines(pCmdLine);
+        return; // Command was executed
+    }
+
+    pid = spawnCommand(pCmdLine, -1, -1, pCmdLine->blocking && !job_control ? -1 : 0);
+
+    if (pid > 0){
+        if(debug_mode){
+            fprintf(stderr, "PID: %d\n", pid);
+            fprintf(stderr, "Executing command: %s\n", command);
+        }
+        
+        if(pCmdLine->blocking){
+            addProcess(&process_list, pCmdLine, pid, job_control ? pid : 0, RUNNING);
+            foreground.pids = &pid;
+            foreground.statuses = &status;
+            foreground.count = 1;
+            waitForJob(job_control ? pid : 0, 1, pid); // Wait for child process to finish
+            foreground.count = 0;
+        }
+        else{
+            addProcess(&process_list, pCmdLine, pid, pid, RUNNING);
+        }
+    }
+    // A failed launch was already reported by the launcher
+    else{
+        last_status = launch_status;
+    }
+    freeCmdLines(pCmdLine);
+}
+
+static void *historyWriter(void *unused){
+    char *buffer;
+    size_t length;
+
+    pthread_mutex_lock(&history_file.lock);
+    while(1){
+        while(history_file.length == 0 && !history_file.stop){
+            pthread_cond_wait(&history_file.wake, &history_file.lock);
+        }
+        if(history_file.length == 0){
+            break; // Stopping and everything is written
+        }
+        // Take the whole batch and write it without holding the lock
+        buffer = history_file.pending;
+        length = history_file.length;
+        history_file.pending = NULL;
+        history_file.length = history_file.capacity = 0;
+        pthread_mutex_unlock(&history_file.lock);
+
+        if(write(history_file.fd, buffer, length) != (ssize_t)length){
+            perror("history write failed");
+        }
+        free(buffer);
+        pthread_mutex_lock(&history_file.lock);
+    }
+    pthread_mutex_unlock(&history_file.lock);
+    return NULL;
+}
+
+// Size the ring from $HISTSIZE, load the tail of $HISTFILE (~/.myshell_history by default, empty to
+// disable) and start the writer. The file is mapped and only its last $HISTSIZE lines are looked at,
+// so startup does not depend on how long the file has grown.
+void initHistory(){
+    const char *size = getenv("HISTSIZE"), *path = getenv("HISTFILE"), *home = getenv("HOME");
+    char default_path[PATH_MAX];
+    const char *start, *end, *line, *newline;
+    struct stat info;
+    sigset_t all, saved;
+    long long start_ns = monotonicNs();
+    int fd;
+
+    history.capacity = size != NULL && atoi(size) > 0 ? atoi(size) : HISTSIZE_DEFAULT;
+    history.entries = (history_entry*) malloc(history.capacity * sizeof(history_entry));
+    if(history.entries == NULL){
+        perror("malloc failed");
+        exit(1);
+    }
+
+    if(path == NULL){
+        snprintf(default_path, sizeof(default_path), "%s/.myshell_history", home != NULL ? home : ".");
+        path = default_path;
+    }
+    if(path[0] == '\0'){
+        return;
+    }
+
+    fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if(fd == -1){
+        perror(path);
+        return;
+    }
+    if(fstat(fd, &info) == 0 && info.st_size > 0){
+        history.map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(history.map == MAP_FAILED){
+            history.map = NULL;
+        }
+        else{
+            history.map_size = info.st_size;
+        }
+    }
+
+    if(history.map != NULL){
+        // A torn last line is left out
+        end = history.map + history.map_size;
+        newline = memrchr(history.map, '\n', history.map_size);
+        end = newline != NULL ? newline + 1 : history.map;
+
+        // Walk back over at most capacity lines, then load them oldest first
+        start = end;
+        for(int lines = 0; lines < history.capacity && start > history.map; lines++){
+            newline = start - 1 > history.map ? memrchr(history.map, '\n', start - 1 - history.map) : NULL;
+            start = newline != NULL ? newline + 1 : history.map;
+        }
+        for(line = start; line < end; line = newline + 1){
+            newline = memchr(line, '\n', end - line);
+            history.entries[history.size].text = line;
+            history.entries[history.size].length = newline + 1 - line;
+            history.entries[history.size++].owned = 0;
+        }
+    }
+    if(debug_mode){
+        fprintf(stderr, "history: %d of %lu bytes loaded in %lld us\n", history.size,
+                (unsigned long)history.map_size, (monotonicNs() - start_ns) / 1000);
+    }
+
+    // The writer must not take the SIGCHLD wake-ups of the main thread
+    history_file.fd = fd;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &saved);
+    if(pthread_create(&history_file.thread, NULL, historyWriter, NULL) != 0){
+        perror("pthread_create failed");
+        close(fd);
+        history_file.fd = -1;
+    }
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+}
+
+static unsigned int trigramAt(const char *text){
+    return (unsigned char)text[0] << 16 | (unsigned char)text[1] << 8 | (unsigned char)text[2];
+}
+
+// Posting list slot of the trigram: its own, or the empty slot it would take
+static trigram_postings *trigramSlot(unsigned int trigram){
+    unsigned int slot = (trigram * 2654435761u) & (history_search.slot_count - 1);
+
+    while(history_search.slots[slot].trigram != 0 && history_search.slots[slot].trigram != trigram){
+        slot = (slot + 1) & (history_search.slot_count - 1);
+    }
+    return &history_search.slots[slot];
+}
+
+static void growHistoryIndex(){
+    trigram_postings *old_slots = history_search.slots;
+    int old_count = history_search.slot_count;
+
+    history_search.slot_count = old_count ? 2 * old_count : 4096;
+    history_search.slots = (trigram_postings*) calloc(history_search.slot_count, sizeof(trigram_postings));
+    if(history_search.slots == NULL){
+        perror("malloc failed");
+        exit(1);
+    }
+    for(int i = 0; i < old_count; i++){
+        if(old_slots[i].trigram != 0){
+            *trigramSlot(old_slots[i].trigram) = old_slots[i];
+        }
+    }
+    free(old_slots);
+}
+
+// Drop line numbers that left the ring from the front of a posting list
+static void trimPostings(trigram_postings *postings){
+    while(postings->start < postings->count && postings->lines[postings->start] < history.evicted){
+        postings->start++;
+    }
+    // Give the space back once most of the list is stale
+    if(postings->start > 16 && postings->start > postings->count / 2){
+        memmove(postings->lines, postings->lines + postings->start, (postings->count - postings->start) * sizeof(unsigned int));
+        postings->count -= postings->start;
+        postings->start = 0;
+    }
+}
+
+static void indexHistoryLine(unsigned int line, const history_entry *entry){
+    trigram_postings *postings;
+    unsigned int trigram;
+    int length = entry->length;
+
+    if(length > 0 && entry->text[length - 1] == '\n'){
+        length--;
+    }
+    for(int i = 0; i + 3 <= length; i++){
+        trigram = trigramAt(entry->text + i);
+        if(trigram == 0){
+            continue;
+        }
+        if(2 * (history_search.used + 1) > history_search.slot_count){
+            growHistoryIndex();
+        }
+        postings = trigramSlot(trigram);
+        if(postings->trigram == 0){
+            postings->trigram = trigram;
+            history_search.used++;
+        }
+        // A trigram seen twice in the line is listed once
+        if(postings->count > postings->start && postings->lines[postings->count - 1] == line){
+            continue;
+        }
+        trimPostings(postings);
+        if(postings->count == postings->capacity){
+            postings->capacity = postings->capacity ? 2 * postings->capacity : 4;
+            postings->lines = (unsigned int*) realloc(postings->lines, postings->capacity * sizeof(unsigned int));
+            if(postings->lines == NULL){
+                perror("malloc failed");
+                exit(1);
+            }
+        }
+        postings->lines[postings->count++] = line;
+    }
+}
+
+static void buildHistoryIndex(){
+    long long start_ns = monotonicNs();
+
+    if(history_search.slot_count == 0){
+        growHistoryIndex();
+    }
+    for(int n = 0; n < history.size; n++){
+        indexHistoryLine(history.evicted + n, &history.entries[(history.head + n) % history.capacity]);
+    }
+    history_search.built = 1;
+    if(debug_mode){
+        fprintf(stderr, "history index: %d lines, %d trigrams built in %lld us\n",
+                history.size, history_search.used, (monotonicNs() - start_ns) / 1000);
+    }
+}
+
+static void freeHistoryIndex(){
+    for(int i = 0; i < history_search.slot_count; i++){
+        free(history_search.slots[i].lines);
+    }
+    free(history_search.slots);
+    memset(&history_search, 0, sizeof(history_index));
+}
+
+static const history_entry *historyEntry(int n);
+
+// Whether the line contains pattern, or starts with it
+static int historyLineMatches(const history_entry *entry, const char *pattern, size_t length, int prefix){
+    size_t text_length = entry->length;
+
+    if(text_length > 0 && entry->text[text_length - 1] == '\n'){
+        text_length--;
+    }
+    if(prefix){
+        return text_length >= length && memcmp(entry->text, pattern, length) == 0;
+    }
+    return memmem(entry->text, text_length, pattern, length) != NULL;
+}
+
+// Candidate lines for a pattern: the posting list of its rarest trigram. Returns 0 when no line can
+// match, -1 when the pattern is too short to use the index (every line is a candidate).
+static int historyCandidates(const char *pattern, size_t length, trigram_postings **best){
+    trigram_postings *postings;
+
+    if(length < 3){
+        return -1;
+    }
+    if(!history_search.built){
+        buildHistoryIndex();
+    }
+    *best = NULL;
+    for(size_t i = 0; i + 3 <= length; i++){
+        postings = trigramSlot(trigramAt(pattern + i));
+        if(postings->trigram == 0){
+            return 0;
+        }
+        trimPostings(postings);
+        if(*best == NULL || postings->count - postings->start < (*best)->count - (*best)->start){
+            *best = postings;
+        }
+    }
+    return 1;
+}
+
+// Newest line before line number 'before' that contains pattern (starts with it when prefix is set),
+// as a 1 based history number, or 0 if there is none
+static int findInHistory(const char *pattern, int prefix, unsigned int before){
+    trigram_postings *postings;
+    size_t length = strlen(pattern);
+    int kind = historyCandidates(pattern, length, &postings), low, high, mid;
+    unsigned int line;
+
+    if(kind == 0){
+        return 0;
+    }
+    if(kind == -1){
+        for(line = before; line-- > history.evicted;){
+            if(historyLineMatches(historyEntry(line - history.evicted + 1), pattern, length, prefix)){
+                return line - history.evicted + 1;
+            }
+        }
+        return 0;
+    }
+    // Binary search for the first listed line at or after 'before', then walk back
+    low = postings->start;
+    high = postings->count;
+    while(low < high){
+        mid = (low + high) / 2;
+        if(postings->lines[mid] < before){
+            low = mid + 1;
+        }
+        else{
+            high = mid;
+        }
+    }
+    while(low-- > postings->start){
+        line = postings->lines[low];
+        if(historyLineMatches(historyEntry(line - history.evicted + 1), pattern, length, prefix)){
+            return line - history.evicted + 1;
+        }
+    }
     return 0;
-}
\ No newline at end of file
+}
+
+// hist grep <pattern> / hist -n <prefix>: every history line containing pattern, or starting with it
+void searchHistory(const char *pattern, int prefix){
+    trigram_postings *postings;
+    size_t length = strlen(pattern);
+    long long start_ns = monotonicNs();
+    int kind = historyCandidates(pattern, length, &postings), matches = 0, n;
+
+    if(kind == -1){
+        for(n = 1; n <= history.size; n++){
+            if(historyLineMatches(historyEntry(n), pattern, length, prefix)){
+                printf("%d: %.*s", n, historyEntry(n)->length, historyEntry(n)->text);
+                matches++;
+            }
+        }
+    }
+    else if(kind == 1){
+        for(int i = postings->start; i < postings->count; i++){
+            n = postings->lines[i] - history.evicted + 1;
+            if(historyLineMatches(historyEntry(n), pattern, length, prefix)){
+                printf("%d: %.*s", n, historyEntry(n)->length, historyEntry(n)->text);
+                matches++;
+            }
+        }
+    }
+    last_status = matches ? 0 : 1;
+    if(debug_mode){
+        fprintf(stderr, "history search: %d matches in %lld us\n", matches, (monotonicNs() - start_ns) / 1000);
+    }
+}
+
+void addHistory(const char *terminal_cmd){
+    history_entry *entry;
+    size_t length = strlen(terminal_cmd);
+
+    if(history.capacity == 0){
+        return;
+    }
+    if(history.size == history.capacity){
+        // Full: the newest line takes the place of the oldest one
+        entry = &history.entries[history.head];
+        if(entry->owned){
+            free((char*)entry->text);
+        }
+        history.head = (history.head + 1) % history.capacity;
+        history.evicted++;
+    }
+    else{
+        entry = &history.entries[(history.head + history.size++) % history.capacity];
+    }
+    entry->text = strdup(terminal_cmd);// Duplicate to keep command in history list;
+    if(entry->text == NULL){
+        perror("malloc failed");
+        exit(1);
+    }
+    entry->length = length;
+    entry->owned = 1;
+    if(history_search.built){
+        indexHistoryLine(history.evicted + history.size - 1, entry);
+    }
+
+    if(history_file.fd != -1){
+        pthread_mutex_lock(&history_file.lock);
+        if(history_file.length + length + 1 > history_file.capacity){
+            history_file.capacity = 2 * (history_file.length + length + 1);
+            history_file.pending = (char*) realloc(history_file.pending, history_file.capacity);
+            if(history_file.pending == NULL){
+                perror("malloc failed");
+                exit(1);
+            }
+        }
+        memcpy(history_file.pending + history_file.length, terminal_cmd, length);
+        history_file.length += length;
+        if(length == 0 || terminal_cmd[length - 1] != '\n'){
+            history_file.pending[history_file.length++] = '\n';
+        }
+        pthread_cond_signal(&history_file.wake);
+        pthread_mutex_unlock(&history_file.lock);
+    }
+}
+
+// Entry n, 1 being the oldest line kept, or NULL if there is none
+static const history_entry *historyEntry(int n){
+    if(n < 1 || n > history.size){
+        return NULL;
+    }
+    return &history.entries[(history.head + n - 1) % history.capacity];
+}
+
+void printHistory(){
+    const history_entry *entry;
+
+    for(int count = 1; (entry = historyEntry(count)) != NULL; count++){
+        printf("%d: %.*s", count, entry->length, entry->text);
+    }
+}
+
+const history_entry *print_n_Command(int n){
+    const history_entry *entry = historyEntry(n);
+
+    if(entry == NULL){
+        printf("history number %d does not exist\n", n);
+    }
+    return entry;
+}
+
+// Stop the writer once everything pending is on disk, then release the ring and the mapping
+void free_historyList(){
+    if(history_file.fd != -1){
+        pthread_mutex_lock(&history_file.lock);
+        history_file.stop = 1;
+        pthread_cond_signal(&history_file.wake);
+        pthread_mutex_unlock(&history_file.lock);
+        pthread_join(history_file.thread, NULL);
+        close(history_file.fd);
+        history_file.fd = -1;
+    }
+
+    for(int count = 1; count <= history.size; count++){
+        history_entry *entry = &history.entries[(history.head + count - 1) % history.capacity];
+        if(entry->owned){
+            free((char*)entry->text);
+        }
+    }
+    free(history.entries);
+    freeHistoryIndex();
+    if(history.map != NULL){
+        munmap(history.map, history.map_size);
+    }
+    memset(&history, 0, sizeof(history_ring));
+}
+
+// Debug mode summary of the time the shell spent launching commands with the active backend
+void printSpawnStats(){
+    if(debug_mode && spawn_count > 0){
+        fprintf(stderr, "%s backend: %ld launches, average spawn latency %lld us\n",
+                fork_backend ? "fork" : "posix_spawn", spawn_count, spawn_total_ns / spawn_count / 1000);
+        fprintf(stderr, "path cache: %ld stat calls resolving commands, execvp would have made %ld execve calls\n",
+                path_lookup_syscalls, path_execvp_syscalls);
+    }
+}
+
+void quit(){
+    drainJobQueue();
+    printSpawnStats();
+    clearPathCache();
+    for(int i = 0; i < done_count; i++){
+        free(done_list[i].command);
+    }
+    free(done_list);
+    freeJobQueue();
+    freeProcessList(&process_list);
+    free_historyList();
+    free(pipe_status);
+    for(int i = 0; i < shell_var_count; i++){
+        free(shell_vars[i]);
+    }
+    free(shell_vars);
+    free(shell_env.slots);
+}
+
+
+// Remove the first count arguments of a prefix builtin such as 'time' or 'prio'
+static void dropLeadingArgs(cmdLine *cmd, int count){
+    memmove((char**)cmd->arguments, cmd->arguments + count, (cmd->argCount - count + 1) * sizeof(char*));
+    cmd->argCount -= count;
+}
+
+static double elapsedSeconds(const struct timeval *from, const struct timeval *to){
+    return (to->tv_sec - from->tv_sec) + (to->tv_usec - from->tv_usec) / 1e6;
+}
+
+// bash style report of the 'time' prefix
+static void printTimes(long long real_ns, const struct rusage *before, const struct rusage *after){
+    double user = elapsedSeconds(&before->ru_utime, &after->ru_utime);
+    double sys = elapsedSeconds(&before->ru_stime, &after->ru_stime);
+
+    fprintf(stderr, "\nreal\t%dm%.3fs\nuser\t%dm%.3fs\nsys\t%dm%.3fs\n",
+            (int)(real_ns / 60000000000LL), (real_ns % 60000000000LL) / 1e9,
+            (int)(user / 60), user - 60 * (int)(user / 60), (int)(sys / 60), sys - 60 * (int)(sys / 60));
+}
+
+// Copy of word with the $? the parser marked (STATUS_LAST) replaced by the status of the last
+// pipeline and each $PIPESTATUS (STATUS_PIPE) by the statuses of its stages, separated by spaces.
+// Quoted ones were left as text. NULL if the word has neither.
+static char *expandStatus(const char *word){
+    const char *from;
+    char *expanded, *out;
+    size_t length;
+
+    if(strpbrk(word, "\005\006") == NULL){
+        return NULL;
+    }
+    // Every expansion is at most 4 bytes a status, 3 digits and a space
+    length = strlen(word) + 1;
+    for(from = word; (from = strpbrk(from, "\005\006")) != NULL; from++){
+        length += 4 * (pipe_status_count + 1);
+    }
+    expanded = out = (char*) malloc(length);
+    if(expanded == NULL){
+        perror("malloc failed");
+        exit(1);
+    }
+    for(from = word; *from; ){
+        if(*from == STATUS_LAST){
+            out += sprintf(out, "%d", last_status);
+            from++;
+        }
+        else if(*from == STATUS_PIPE){
+            for(int i = 0; i < pipe_status_count; i++){
+                out += sprintf(out, i ? " %d" : "%d", pipe_status[i]);
+            }
+            from++;
+        }
+        else{
+            *out++ = *from++;
+        }
+    }
+    *out = '\0';
+    return expanded;
+}
+
+// $? and $PIPESTATUS in the arguments, assignments, redirections and '<<<' words of every stage
+static void expandStatuses(cmdLine *cmd){
+    char *expanded;
+
+    for(; cmd != NULL; cmd = cmd->next){
+        for(int i = 0; i < cmd->argCount; i++){
+            if((expanded = expandStatus(cmd->arguments[i])) != NULL){
+                replaceCmdArg(cmd, i, expanded);
+                free(expanded);
+            }
+        }
+        for(int i = 0; i < cmd->assignmentCount; i++){
+            if((expanded = expandStatus(cmd->assignments[i])) != NULL){
+                replaceCmdAssignment(cmd, i, expanded);
+                free(expanded);
+            }
+        }
+        if(cmd->inputRedirect != NULL && (expanded = expandStatus(cmd->inputRedirect)) != NULL){
+            replaceRedirect(cmd, 0, expanded);
+            free(expanded);
+        }
+        if(cmd->outputRedirect != NULL && (expanded = expandStatus(cmd->outputRedirect)) != NULL){
+            replaceRedirect(cmd, 1, expanded);
+            free(expanded);
+        }
+        if(cmd->hereData != NULL && (expanded = expandStatus(cmd->hereData)) != NULL){
+            replaceHereData(cmd, expanded);
+            free(expanded);
+        }
+    }
+}
+
+// Run command in a forked copy of the shell and return its output, without the trailing newlines.
+// The output is read from a pipe into a buffer that doubles as it fills, it never touches a file.
+static char *captureOutput(const char *command){
+    int pipe_fd[2], status;
+    size_t length = 0, capacity = 4096;
+    ssize_t got;
+    char *output, *line;
+    pid_t pid;
+
+    output = (char*) malloc(capacity);
+    if(output == NULL){
+        perror("malloc failed");
+        exit(1);
+    }
+    if(pipe2(pipe_fd, O_CLOEXEC) == -1){
+        perror("pipe failed");
+        output[0] = '\0';
+        return output;
+    }
+
+    fflush(stdout);
+    pid = fork();
+    if(pid == 0){
+        dup2(pipe_fd[1], 1);
+        enterForkedChild(-1);
+        installSigchldHandler();
+        // A plain non-interactive shell: the jobs of the parent are not its own
+        interactive = job_control = 0;
+        read_more = NULL;
+        freeJobQueue();
+        line = strdup(command);
+        runLine(line);
+        fflush(stdout);
+        _exit(last_status);
+    }
+    close(pipe_fd[1]);
+    if(pid < 0){
+        perror("fork failed");
+        close(pipe_fd[0]);
+        output[0] = '\0';
+        return output;
+    }
+
+    for(;;){
+        if(length + 1 == capacity){
+            capacity *= 2;
+            output = (char*) realloc(output, capacity);
+            if(output == NULL){
+                perror("malloc failed");
+                exit(1);
+            }
+        }
+        got = read(pipe_fd[0], output + length, capacity - length - 1);
+        if(got == -1 && errno == EINTR){
+            continue;
+        }
+        if(got <= 0){
+            break;
+        }
+        length += got;
+    }
+    close(pipe_fd[0]);
+    while(waitpid(pid, &status, 0) == -1 && errno == EINTR);
+
+    while(length > 0 && output[length - 1] == '\n'){
+        length--;
+    }
+    output[length] = '\0';
+    if(debug_mode){
+        fprintf(stderr, "command substitution: %zu bytes captured\n", length);
+    }
+    return output;
+}
+
+// Growable array of the words an argument expands to
+typedef struct word_list{
+    char **words;
+    int count;
+    int capacity;
+} word_list;
+
+static void addWord(word_list *list, char *word){
+    if(list->count == list->capacity){
+        list->capacity = list->capacity ? 2 * list->capacity : 16;
+        list->words = (char**) realloc(list->words, list->capacity * sizeof(char*));
+        if(list->words == NULL){
+            perror("malloc failed");
+            exit(1);
+        }
+    }
+    list->words[list->count++] = word;
+}
+
+// Replace each $(...) of word by the output of its command. Unquoted output is split at blanks
+// and newlines, its first and last words joining the text around the substitution. The words
+// are added to list; an unquoted substitution that prints nothing leaves no word behind.
+static void expandWord(const char *word, word_list *list){
+    char *current, *output, *command, *out;
+    const char *end;
+    size_t capacity = strlen(word) + 1, length = 0, room;
+    int present = 0;  // current is a word even if empty, as "$(true)" is
+
+    current = (char*) malloc(capacity);
+    if(current == NULL){
+        perror("malloc failed");
+        exit(1);
+    }
+    while(*word){
+        if(*word != SUBST_BEGIN && *word != SUBST_QUOTED){
+            current[length++] = *word++;
+            present = 1;
+            continue;
+        }
+
+        end = strchr(word, SUBST_END);
+        command = strndup(word + 1, end - word - 1);
+        output = captureOutput(command);
+        free(command);
+
+        // Room for the whole output, and what is left of word after it
+        room = length + strlen(output) + strlen(end) + 1;
+        if(room > capacity){
+            capacity = room;
+            current = (char*) realloc(current, capacity);
+            if(current == NULL){
+                perror("malloc failed");
+                exit(1);
+            }
+        }
+
+        if(*word == SUBST_QUOTED){
+            length += sprintf(current + length, "%s", output);
+            present = 1;
+        }
+        else{
+            for(out = output; *out; out++){
+                if(*out == ' ' || *out == '\t' || *out == '\n'){
+                    if(present){
+                        current[length] = '\0';
+                        addWord(list, strdup(current));
+                        length = present = 0;
+                    }
+                }
+                else{
+                    current[length++] = *out;
+                    present = 1;
+                }
+            }
+        }
+        free(output);
+        word = end + 1;
+    }
+    if(present){
+        current[length] = '\0';
+        addWord(list, strdup(current));
+    }
+    free(current);
+}
+
+// Expand a redirection path or '<<<' word: the parser marks its substitutions as quoted, so it
+// stays one word. Returns it malloc'ed.
+static char *expandWhole(const char *word){
+    word_list list = {NULL, 0, 0};
+    char *whole;
+
+    expandWord(word, &list);
+    whole = list.count > 0 ? list.words[0] : strdup("");
+    free(list.words);
+    return whole;
+}
+
+// Run the command substitutions of every argument, which then expand to any number of words,
+// and those of the redirections and assignments
+static void expandSubstitutions(cmdLine *cmd){
+    word_list list = {NULL, 0, 0};
+    char *whole;
+
+    for(; cmd != NULL; cmd = cmd->next){
+        if(cmd->inputRedirect != NULL && strchr(cmd->inputRedirect, SUBST_QUOTED) != NULL){
+            whole = expandWhole(cmd->inputRedirect);
+            replaceRedirect(cmd, 0, whole);
+            free(whole);
+        }
+        if(cmd->outputRedirect != NULL && strchr(cmd->outputRedirect, SUBST_QUOTED) != NULL){
+            whole = expandWhole(cmd->outputRedirect);
+            replaceRedirect(cmd, 1, whole);
+            free(whole);
+        }
+        if(cmd->hereData != NULL && strchr(cmd->hereData, SUBST_QUOTED) != NULL){
+            whole = expandWhole(cmd->hereData);
+            replaceHereData(cmd, whole);
+            free(whole);
+        }
+        for(int i = 0; i < cmd->assignmentCount; i++){
+            if(strchr(cmd->assignments[i], SUBST_QUOTED) != NULL){
+                whole = expandWhole(cmd->assignments[i]);
+                replaceCmdAssignment(cmd, i, whole);
+                free(whole);
+            }
+        }
+        for(int i = 0; i < cmd->argCount; i++){
+            if(strpbrk(cmd->arguments[i], "\001\002") == NULL){
+                continue;
+            }
+            expandWord(cmd->arguments[i], &list);
+            spliceCmdArgs(cmd, i, list.words, list.count);
+            i += list.count - 1;
+            for(int w = 0; w < list.count; w++){
+                free(list.words[w]);
+            }
+            list.count = 0;
+        }
+    }
+    free(list.words);
+}
+
+// Run one pipeline of a command line, prefixes included, and leave its status in last_status.
+// Takes ownership of cmd.
+static void runPipeline(cmdLine *cmd){
+    struct rusage before, after;
+    long long start_ns = 0;
+    cmdLine *stage;
+    int priority = 0, timed = 0, profile = 0;
+    long pipesz = 0;
+
+    expandStatuses(cmd);
+    expandSubstitutions(cmd);
+    expandCmdGlobs(cmd, glob_sort);
+
+    // NAME=value with no command sets shell variables
+    if(cmd->next == NULL && cmd->argCount == 0 && cmd->assignmentCount > 0){
+        for(int i = 0; i < cmd->assignmentCount; i++){
+            assignVariable(cmd->assignments[i], 0);
+        }
+        last_status = 0;
+        freeCmdLines(cmd);
+        return;
+    }
+
+    // Only expansions that came out empty, as in $(true)
+    for(stage = cmd; stage != NULL && stage->argCount > 0; stage = stage->next);
+    if(stage != NULL){
+        if(cmd->next != NULL){
+            fprintf(stderr, "missing command after expansion\n");
+            last_status = 2;
+        }
+        freeCmdLines(cmd);
+        return;
+    }
+
+    // Prefix builtins, in any order:
+    //   time command: report the real, user and sys time of a foreground command or pipeline
+    //   profile command: attach perf counters to every process of the job, reported when it is reaped
+    //   prio N command: launch at nice value N; among queued jobs, lower values are admitted first
+    //   pipesz SIZE command: buffer size of the job's pipes, instead of the one of 'set pipesz'
+    while(cmd->argCount > 1){
+        if(strcmp(cmd->arguments[0], "time") == 0){
+            timed = 1;
+            dropLeadingArgs(cmd, 1);
+        }
+        else if(strcmp(cmd->arguments[0], "profile") == 0){
+            profile = 1;
+            dropLeadingArgs(cmd, 1);
+        }
+        else if(strcmp(cmd->arguments[0], "prio") == 0){
+            if(cmd->argCount < 3){
+                fprintf(stderr, "usage: prio N command [args]\n");
+                freeCmdLines(cmd);
+                last_status = 2;
+                return;
+            }
+            priority = atoi(cmd->arguments[1]);
+            dropLeadingArgs(cmd, 2);
+        }
+        else if(strcmp(cmd->arguments[0], "pipesz") == 0){
+            if(cmd->argCount < 3 || (pipesz = pipeSizeArg(cmd->arguments[1])) < 0){
+                fprintf(stderr, "usage: pipesz SIZE command [| command ...]\n");
+                freeCmdLines(cmd);
+                last_status = 2;
+                return;
+            }
+            dropLeadingArgs(cmd, 2);
+        }
+        else{
+            break;
+        }
+    }
+
+    // A blocking pipeline records the status of each of its stages, anything else only has one
+    pipe_status_count = 0;
+    for(stage = cmd; stage->next != NULL; stage = stage->next);
+    // Background jobs over the maxjobs limit wait their turn, behind any job queued before them
+    if(!stage->blocking && max_jobs > 0 && (queued_jobs.count > 0 || process_list.running >= max_jobs)){
+        queueJob(cmd, priority, profile, pipesz);
+        last_status = 0;
+    }
+    else if(timed && stage->blocking){
+        // Children's rusage covers every stage, as they are all waited for before launchJob returns
+        getrusage(RUSAGE_CHILDREN, &before);
+        start_ns = monotonicNs();
+        launchJob(cmd, priority, profile, pipesz);
+        getrusage(RUSAGE_CHILDREN, &after);
+        printTimes(monotonicNs() - start_ns, &before, &after);
+    }
+    else{
+        launchJob(cmd, priority, profile, pipesz);
+    }
+    if(pipe_status_count == 0){
+        setPipeStatus(0, last_status);
+    }
+}
+
+// Read the body of the '<<' here-doc of stage: the lines up to its delimiter
+static void readHereDoc(cmdLine *stage){
+    char *line = NULL, *body = NULL;
+    size_t capacity = 0, body_capacity = 0, size = 0;
+    ssize_t length;
+
+    for(;;){
+        length = read_more != NULL ? read_more(&line, &capacity) : -1;
+        if(length == -1){
+            fprintf(stderr, "warning: here-doc delimited by end of input (wanted '%s')\n", stage->hereData);
+            break;
+        }
+        if(length > 0 && line[length - 1] == '\n'){
+            line[--length] = '\0';
+        }
+        if(strcmp(line, stage->hereData) == 0){
+            break;
+        }
+        if(size + length + 2 > body_capacity){
+            body_capacity = 2 * (size + length + 2);
+            body = (char*) realloc(body, body_capacity);
+            if(body == NULL){
+                perror("malloc failed");
+                exit(1);
+            }
+        }
+        memcpy(body + size, line, length);
+        size += length;
+        body[size++] = '\n';
+    }
+    if(body != NULL){
+        body[size] = '\0';
+    }
+    replaceHereData(stage, body != NULL ? body : "");
+    free(body);
+    free(line);
+}
+
+// Parse and run one command line: pipelines joined by ';', '&', '&&' and '||'. Returns 0 once
+// the shell has to stop: the line was 'quit', or a command failed while set -e is on. As in
+// bash, set -e lets a command whose status a '&&' or '||' tests fail.
+int runLine(char *input){
+    static long line_max = 0;
+    cmdList *list, *item;
+    cmdLine *stage;
+    int run = 1;
+
+    input[strcspn(input, "\n")] = '\0';
+    input += strspn(input, " \t");
+
+    // A line can be as long as memory allows, but the arguments of a command still have to fit
+    // in what execve accepts
+    if(line_max == 0){
+        line_max = sysconf(_SC_ARG_MAX);
+        if(line_max <= 0){
+            line_max = 1 << 21;
+        }
+    }
+    if(strlen(input) >= (size_t)line_max){
+        fprintf(stderr, "line too long: %zu bytes, the limit is %ld\n", strlen(input), line_max);
+        last_status = 1;
+        return !errexit;
+    }
+
+    // Script comments, including a #! line
+    if(input[0] == '#'){
+        return 1;
+    }
+
+    // User entered quit, exit program 
+    if(strncmp(input,"quit",4) == 0){
+        return 0;
+    }
+
+    list = parseCmdList(input);
+
+    // A pipeline missing next to '&&' or '||' or malformed, or a stage made only of redirections, has nothing to run
+    for(item = list; item != NULL; item = item->next){
+        // Except for a lone stage of assignments, as in 'NAME=value'
+        if(item->pipeline != NULL && item->pipeline->next == NULL && item->pipeline->assignmentCount > 0){
+            continue;
+        }
+        for(stage = item->pipeline; stage != NULL && stage->argCount > 0; stage = stage->next);
+        if(item->pipeline == NULL || stage != NULL){
+            fprintf(stderr, "syntax error: %s\n", item->pipeline == NULL ? item->error : "missing command");
+            freeCmdList(list);
+            last_status = 2;
+            return !errexit;
+        }
+    }
+
+    // Here-doc bodies follow the line, in the order of their '<<'
+    for(item = list; item != NULL; item = item->next){
+        for(stage = item->pipeline; stage != NULL; stage = stage->next){
+            if(stage->hereDoc){
+                readHereDoc(stage);
+            }
+        }
+    }
+
+    for(item = list; item != NULL; item = item->next){
+        if(run){
+            runPipeline(item->pipeline);
+            item->pipeline = NULL;
+            if(errexit && last_status != 0 && item->connector == LIST_SEQ){
+                freeCmdList(list);
+                return 0;
+            }
+        }
+        // A skipped pipeline passes the status on: in 'a && b || c', c runs when a fails
+        run = item->connector == LIST_SEQ || (item->connector == LIST_AND) == (last_status == 0);
+    }
+
+    freeCmdList(list);
+    reapChildren();
+    return 1;
+}
+
+// Unread part of the string or script being run
+static const char *batch_next, *batch_end;
+
+// Copy the next line of the batch into line, as getline would
+static ssize_t readBatchLine(char **line, size_t *capacity){
+    const char *end;
+    size_t length;
+
+    if(batch_next >= batch_end){
+        return -1;
+    }
+    end = memchr(batch_next, '\n', batch_end - batch_next);
+    if(end == NULL){
+        end = batch_end;
+    }
+    length = end - batch_next;
+    if(length + 1 > *capacity){
+        *capacity = 2 * (length + 1);
+        *line = (char*) realloc(*line, *capacity);
+        if(*line == NULL){
+            perror("malloc failed");
+            exit(1);
+        }
+    }
+    memcpy(*line, batch_next, length);
+    (*line)[length] = '\0';
+    batch_next = end + 1;
+    return length;
+}
+
+// Run every line of data, one at a time; here-docs take their bodies from the lines that follow
+static int runBuffer(const char *data, size_t size){
+    char *buffer = NULL;
+    size_t capacity = 0;
+    int keep_going = 1;
+
+    batch_next = data;
+    batch_end = data + size;
+    read_more = readBatchLine;
+    while(keep_going && readBatchLine(&buffer, &capacity) != -1){
+        keep_going = runLine(buffer);
+    }
+    read_more = NULL;
+    free(buffer);
+    return keep_going;
+}
+
+// myshell -c "commands": run each line of the string
+int runString(const char *commands){
+    return runBuffer(commands, strlen(commands));
+}
+
+// myshell script: the file is mapped instead of read, lines are copied out one at a time
+int runScript(const char *path){
+    struct stat info;
+    const char *data;
+    int fd, keep_going;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd == -1 || fstat(fd, &info) == -1){
+        perror(path);
+        last_status = 127;
+        return 0;
+    }
+    if(info.st_size == 0){
+        close(fd);
+        return 1;
+    }
+    data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED){
+        perror("mmap failed");
+        last_status = 1;
+        return 0;
+    }
+    madvise((void*)data, info.st_size, MADV_SEQUENTIAL);
+
+    keep_going = runBuffer(data, info.st_size);
+    munmap((void*)data, info.st_size);
+    return keep_going;
+}
+
+// Append a byte to the edited line, growing it as needed
+static void lineAppend(char **line, size_t *capacity, size_t *length, char c){
+    if(*length + 2 > *capacity){
+        *capacity = *capacity ? 2 * *capacity : 256;
+        *line = (char*) realloc(*line, *capacity);
+        if(*line == NULL){
+            perror("malloc failed");
+            exit(1);
+        }
+    }
+    (*line)[(*length)++] = c;
+    (*line)[*length] = '\0';
+}
+
+// Redraw the ^R search line: the pattern and the line it currently matches
+static void drawSearch(const char *pattern, int match){
+    const history_entry *entry = historyEntry(match);
+    int length = entry != NULL ? entry->length : 0;
+
+    if(length > 0 && entry->text[length - 1] == '\n'){
+        length--;
+    }
+    printf("\r\033[K(%sreverse-i-search)`%s': %.*s", entry != NULL || pattern[0] == '\0' ? "" : "failed ",
+           pattern, length, entry != NULL ? entry->text : "");
+    fflush(stdout);
+}
+
+// Interactive line input with a minimal editor: typing, backspace, ^U to clear, ^C to drop the line,
+// ^D on an empty line for end of input, and ^R for an incremental reverse search of the history.
+// Children that finish while the shell waits for a key are reaped. Returns the line length,
+// newline included, or -1 at end of input.
+static ssize_t readLine(const char *prompt, char **line, size_t *capacity){
+    struct termios saved, raw;
+    struct pollfd fds[2] = {{0, POLLIN, 0}, {sigchld_pipe[0], POLLIN, 0}};
+    char pattern[256];
+    size_t length = 0, pattern_length = 0;
+    int searching = 0, match = 0, found;
+    unsigned char c;
+    ssize_t result = -2;
+    const history_entry *entry;
+
+    lineAppend(line, capacity, &length, '\0');
+    length = 0;
+    printf("%s", prompt);
+    fflush(stdout);
+
+    tcgetattr(0, &saved);
+    raw = saved;
+    raw.c_lflag &= ~(ICANON | ECHO | ISIG); // ^C and ^Z are keys here, not signals
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(0, TCSADRAIN, &raw);
+
+    while(result == -2){
+        if(poll(fds, 2, -1) == -1 || !(fds[0].revents & (POLLIN | POLLHUP | POLLERR))){
+            reapChildren();
+            continue;
+        }
+        if(read(0, &c, 1) != 1){
+            result = length > 0 ? (ssize_t)length : -1;
+            break;
+        }
+
+        if(searching){
+            if(c == 0x12){ // ^R again: the next older match
+                found = findInHistory(pattern, 0, history.evicted + (match ? match - 1 : history.size));
+                match = found ? found : match;
+            }
+            else if(c == 0x7f || c == 0x08){
+                if(pattern_length > 0){
+                    pattern[--pattern_length] = '\0';
+                }
+                match = pattern_length ? findInHistory(pattern, 0, history.evicted + history.size) : 0;
+            }
+            else if(c >= 0x20 && c != 0x7f && pattern_length + 1 < sizeof(pattern)){
+                pattern[pattern_length++] = c;
+                pattern[pattern_length] = '\0';
+                match = findInHistory(pattern, 0, history.evicted + (match ? match : history.size));
+            }
+            else{
+                // Leave the search: ^G drops it, anything else keeps the match, and Enter also runs it
+                searching = 0;
+                if(c != 0x07 && (entry = historyEntry(match)) != NULL){
+                    length = 0;
+                    for(int i = 0; i < entry->length && entry->text[i] != '\n'; i++){
+                        lineAppend(line, capacity, &length, entry->text[i]);
+                    }
+                }
+                printf("\r\033[K%s%s", prompt, *line);
+                if(c == '\n' || c == '\r'){
+                    printf("\n");
+                    lineAppend(line, capacity, &length, '\n');
+                    result = length;
+                }
+                fflush(stdout);
+                continue;
+            }
+            drawSearch(pattern, match);
+            continue;
+        }
+
+        if(c == '\n' || c == '\r'){
+            printf("\n");
+            lineAppend(line, capacity, &length, '\n');
+            result = length;
+        }
+        else if(c == 0x04){ // ^D
+            if(length == 0){
+                result = -1;
+            }
+        }
+        else if(c == 0x03){ // ^C: drop the line and start over
+            printf("^C\n%s", prompt);
+            length = 0;
+            (*line)[0] = '\0';
+        }
+        else if(c == 0x15){ // ^U
+            printf("\r\033[K%s", prompt);
+            length = 0;
+            (*line)[0] = '\0';
+        }
+        else if(c == 0x12){ // ^R
+            searching = 1;
+            pattern_length = 0;
+            pattern[0] = '\0';
+            match = 0;
+            drawSearch(pattern, match);
+        }
+        else if(c == 0x7f || c == 0x08){
+            if(length > 0){
+                // A whole UTF-8 character
+                while(length > 1 && ((*line)[length - 1] & 0xC0) == 0x80){
+                    length--;
+                }
+                (*line)[--length] = '\0';
+                printf("\b \b");
+            }
+        }
+        else if(c == 0x1b){
+            // Escape sequences (arrows and the like) are not supported, skip them whole
+            if(read(0, &c, 1) == 1 && c == '['){
+                while(read(0, &c, 1) == 1 && (c < 0x40 || c > 0x7e));
+            }
+        }
+        else if(c >= 0x20 || c == '\t'){
+            lineAppend(line, capacity, &length, c);
+            putchar(c);
+        }
+        fflush(stdout);
+    }
+
+    tcsetattr(0, TCSADRAIN, &saved);
+    return result;
+}
+
+// Here-doc lines typed at the terminal get a continuation prompt
+static ssize_t readMoreTerminal(char **line, size_t *capacity){
+    return readLine("> ", line, capacity);
+}
+
+static ssize_t readMoreStdin(char **line, size_t *capacity){
+    return getline(line, capacity, stdin);
+}
+
+int main(int argc, char**argv) {
+    char cwd[PATH_MAX];  // Current working directory buffer
+    char prompt[PATH_MAX + 3];
+    char *input = NULL;  // User input buffer, grown by getline to fit the longest line
+    size_t input_capacity = 0;
+    const char *command_string = NULL, *script = NULL;
+
+    for(int i=1; i< argc; i++){
+        // Turn ON debug mode
+        if(strcmp(argv[i], "-d") == 0){
+            debug_mode = 1; 
+        }
+        // Launch with fork()+execvp instead of posix_spawn
+        else if(strcmp(argv[i], "-f") == 0){
+            fork_backend = 1;
+        }
+        // Stop at the first failing command, as set -e
+        else if(strcmp(argv[i], "-e") == 0){
+            errexit = 1;
+        }
+        // Run the given commands instead of reading them
+        else if(strcmp(argv[i], "-c") == 0 && i + 1 < argc){
+            command_string = argv[++i];
+        }
+        else if(script == NULL){
+            script = argv[i];
+        }
+    }
+
+    installSigchldHandler();
+
+    // Batch modes: no prompt, no getcwd and no history
+    if(command_string != NULL || script != NULL){
+        if(command_string != NULL){
+            runString(command_string);
+        }
+        else{
+            runScript(script);
+        }
+        quit();
+        return last_status;
+    }
+
+    interactive = isatty(0);
+    // Job control when the shell is the terminal's foreground process group
+    job_control = interactive && tcgetpgrp(0) == getpgrp();
+    if(job_control){
+        shell_pgid = getpgrp();
+        signal(SIGTSTP, SIG_IGN);
+        signal(SIGTTIN, SIG_IGN);
+        signal(SIGTTOU, SIG_IGN);
+    }
+    read_more = interactive ? readMoreTerminal : readMoreStdin;
+    if(interactive){
+        initHistory();
+        // Unbuffered so poll() on stdin never misses a line already sitting in the stdio buffer
+        setvbuf(stdin, NULL, _IONBF, 0);
+    }
+    else{
+        setvbuf(stdin, NULL, _IOFBF, 1 << 20);
+    }
+
+    while (1) {
+
+        if(interactive){
+            reapChildren();
+            printDoneNotices();
+
+            if (getcwd(cwd, sizeof(cwd)) == NULL) { // Get current working directory
+                perror("getcwd");
+                exit(EXIT_FAILURE);
+            }
+
+            snprintf(prompt, sizeof(prompt), "%s> ", cwd); // Display prompt of current working directory
+        }
+
+        // Read user input
+        if ((interactive ? readLine(prompt, &input, &input_capacity) : getline(&input, &input_capacity, stdin)) == -1) {
+            if(interactive){
+                printf("\n");
+            }
+            break;  // Exit on Ctrl+D
+        }
+
+        if(interactive){
+            const history_entry *entry = NULL;
+
+            if(strncmp(input,"!!",2) == 0){
+                entry = historyEntry(history.size);
+                if (entry != NULL){
+                    printf("%.*s", entry->length, entry->text);
+                }
+                else{
+                    fprintf(stderr, "No history is available\n");
+                }
+            }
+
+            else if (input[0] == '!' && input[1] != '\0') {
+                entry = print_n_Command(atoi(input + 1));
+            }
+
+            if (entry != NULL) {
+                free(input);  // Replace the line with a copy of the command
+                input = strndup(entry->text, entry->length);
+                input_capacity = entry->length + 1;
+            }
+            addHistory(input);
+        }
+
+        if(!runLine(input)){
+            break;
+        }
+    }
+
+    free(input);
+    quit();
+    return last_status;
+}
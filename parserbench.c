@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "LineParser.h"
+
+// Command lines used when no corpus file is given
+static const char *sample_lines[] = {
+    "ls -l /tmp\n",
+    "cat < input.txt | grep -v error | sort | uniq -c > counts.txt\n",
+    "zcat access.log.gz | cut -d ' ' -f 1 | sort | uniq -c | sort -n | tail -20\n",
+    "gcc -m32 -Wall -O2 myshell.c LineParser.c -o myshell\n",
+    "sleep 10 &\n",
+    "find . -name core -type f\n",
+};
+
+static double elapsedSeconds(struct timespec *start){
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Parse and free every line of the corpus rounds times with the given parser
+static void runBench(const char *name, cmdLine *(*parse)(const char *), char **lines, int line_count, int rounds){
+    struct timespec start;
+    double seconds;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(int round = 0; round < rounds; round++){
+        for(int i = 0; i < line_count; i++){
+            freeCmdLines(parse(lines[i]));
+        }
+    }
+    seconds = elapsedSeconds(&start);
+    printf("%-8s %10.0f lines/s  %7.1f ns/line\n", name,
+           (double)line_count * rounds / seconds, seconds * 1e9 / ((double)line_count * rounds));
+}
+
+// Usage: parserbench [rounds] [corpus file, one command line per line]
+int main(int argc, char**argv) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 200000;
+    char **lines = (char**) sample_lines;
+    int line_count = sizeof(sample_lines) / sizeof(sample_lines[0]);
+    int capacity = 0;
+    char *buffer = NULL;
+    size_t buffer_capacity = 0;
+    FILE *corpus;
+
+    if(argc > 2){
+        corpus = fopen(argv[2], "r");
+        if(corpus == NULL){
+            perror("fopen failed");
+            exit(EXIT_FAILURE);
+        }
+        lines = NULL;
+        line_count = 0;
+        while(getline(&buffer, &buffer_capacity, corpus) != -1){
+            if(line_count == capacity){
+                capacity = capacity ? 2 * capacity : 1024;
+                lines = (char**) realloc(lines, capacity * sizeof(char*));
+            }
+            lines[line_count++] = strdup(buffer);
+        }
+        free(buffer);
+        fclose(corpus);
+    }
+
+    printf("%d lines x %d rounds\n", line_count, rounds);
+    runBench("malloc", parseCmdLines, lines, line_count, rounds);
+    runBench("arena", parseCmdLinesArena, lines, line_count, rounds);
+    return 0;
+}